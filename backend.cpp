@@ -0,0 +1,21 @@
+#include "backend.h"
+#include "cpusim.h"
+#include "simulation.h"
+#include "slab.h"
+
+Backend *makeBackend(Scene *sc, Profiler *prof, ClDevicePtr dev) {
+    if (sc->params.seed) {
+        seedRandom(sc->params.seed);
+    }
+
+    if (sc->params.backend == BACKEND_CPU) {
+        return new CpuSimulation(sc, prof);
+    }
+    if (sc->params.slabs > 1) {
+        if (!dev) {
+            return new SlabSimulation(sc, prof);
+        }
+        std::cerr << "Warning: slabs ignored, this run has one device\n";
+    }
+    return new Simulation(sc, prof, dev);
+}
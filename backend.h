@@ -0,0 +1,67 @@
+/* -*- C++ -*- */
+
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include "device.h"
+#include "profiler.h"
+#include "scene.h"
+#include "util.h"
+
+// cell side length (m); h in simulate.cl (set by the CELL_H build option)
+// and cpusim.cpp
+const float CELL_SIZE = 0.25f;
+
+// counters for benchmarks
+struct BackendStats {
+    unsigned steps;             // simulation steps taken
+    size_t gridBytes;           // grid storage, device or host
+};
+
+// common interface of the OpenCL and native CPU simulators
+class Backend {
+public:
+    virtual ~Backend() {}
+
+    virtual void advance() = 0;
+    virtual float getT() = 0;
+
+    // one image per scene camera, all from the same T; may return before
+    // the data is filled in, see HostImage::sync()
+    virtual void render(const std::vector<HostImage *> &imgs) = 0;
+
+    // a quick look at the current T, for interactive runs: rendered at
+    // 1/scale the size with 1/scale the ray samples, then upsampled into
+    // imgs. Each pass adds jittered samples to the ones before, so call it
+    // with pass 0, 1, 2... until the state changes, then start over. Like
+    // render(), it may return before the data is filled in. Backends
+    // without a preview render normally on pass 0 and ignore the rest.
+    virtual void preview(const std::vector<HostImage *> &imgs, int scale,
+        int pass) {
+        if (pass == 0) {
+            render(imgs);
+        }
+    }
+
+    // the SimParams exports channels of the current T, non-empty bricks
+    // only; may return before vol.data is filled in, like render()
+    virtual void exportVolume(VolumeFrame &vol) = 0;
+
+    // replace T and t with an exported frame, for re-rendering
+    virtual void loadVolume(const VolumeFrame &vol) = 0;
+
+    // backend-specific statistics, after the profiler summary
+    virtual void dumpProfiling() = 0;
+    virtual BackendStats stats() = 0;
+
+    // write the simulation state after the given number of frames, or
+    // restore it and return that number; see checkpoint.h
+    virtual void saveCheckpoint(const std::string &fname, int frame) = 0;
+    virtual int loadCheckpoint(const std::string &fname) = 0;
+};
+
+// construct the backend selected by the scene's SimParams; profiling is
+// enabled when prof is non-null, and the OpenCL backend runs on dev if given
+Backend *makeBackend(Scene *sc, Profiler *prof=NULL, ClDevicePtr dev=NULL);
+
+#endif // __BACKEND_H__
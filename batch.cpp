@@ -0,0 +1,136 @@
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+
+#include "batch.h"
+#include "device.h"
+
+std::vector<BatchJob> expandJobs(const std::vector<std::string> &scenes,
+    const std::vector<std::string> &sweeps)
+{
+    std::vector<BatchJob> jobs;
+    for (auto &scene : scenes) {
+        jobs.push_back({scene, "", ""});
+    }
+
+    // each sweep multiplies the jobs so far by its values
+    for (auto &sweep : sweeps) {
+        size_t dot = sweep.find('.'),
+               eq = sweep.find('=');
+        if (dot == std::string::npos || eq == std::string::npos || eq < dot) {
+            std::cerr << "Error: sweep '" << sweep
+                << "' isn't Block.key=value[,value...]\n";
+            exit(1);
+        }
+        std::string block = sweep.substr(0, dot),
+                    key = sweep.substr(dot + 1, eq - dot - 1);
+
+        std::vector<BatchJob> grown;
+        for (auto &job : jobs) {
+            std::stringstream values(sweep.substr(eq + 1));
+            std::string value;
+            while (std::getline(values, value, ',')) {
+                BatchJob j = job;
+                j.overrides += block + " { " + key + " " + value + " }\n";
+                j.label += (j.label.empty() ? "" : " ") + block + "." + key
+                    + "=" + value;
+                grown.push_back(j);
+            }
+        }
+        jobs.swap(grown);
+    }
+    return jobs;
+}
+
+void runBatch(const std::vector<BatchJob> &jobs, unsigned perDevice,
+    RunOptions opts)
+{
+    // a slot runs one job at a time and sticks to its device
+    std::vector<ClDevicePtr> slotDevs;
+    for (auto &dev : openDevices(perDevice)) {
+        slotDevs.insert(slotDevs.end(), dev->jobs, dev);
+    }
+    const unsigned slots = slotDevs.size();
+    std::cout << "Batch: " << jobs.size() << " jobs, " << slots
+        << " at a time\n";
+
+    // split the encoder threads between the jobs running at once
+    if (opts.encThreads == 0) {
+        opts.encThreads = std::max(1u, std::thread::hardware_concurrency() / slots);
+    }
+    opts.status = false;
+
+    struct Result {
+        int frames;
+        double secs;
+    };
+    std::vector<Result> results(jobs.size());
+    std::atomic<size_t> next(0);
+    std::mutex mtx;
+    size_t done = 0;
+
+    // one thread per slot, each pulling the next job as it finishes one
+    auto t0 = time_now();
+    std::vector<std::thread> threads;
+    for (unsigned s = 0; s < slots; s++) {
+        ClDevicePtr dev = slotDevs[s];
+        threads.emplace_back([&, dev] {
+            for (size_t k = next++; k < jobs.size(); k = next++) {
+                const BatchJob &job = jobs[k];
+                std::ostringstream dir;
+                dir << opts.outDir << "/job-" << std::setfill('0')
+                    << std::setw(3) << k;
+                mkdir(dir.str().c_str(), 0755);
+                std::ofstream(dir.str() + "/job.txt") << job.scene << "\n"
+                    << job.overrides;
+
+                RunOptions o = opts;
+                o.outDir = dir.str();
+                auto t1 = time_now();
+                Scene scene(job.scene, job.overrides);
+                {
+                    std::unique_ptr<Backend> sim(makeBackend(&scene, NULL, dev));
+                    results[k].frames = runFrames(scene, *sim, NULL, o);
+                }
+                results[k].secs = time_since(t1);
+
+                std::lock_guard<std::mutex> lock(mtx);
+                std::cout << "[" << ++done << "/" << jobs.size() << "] job-"
+                    << std::setfill('0') << std::setw(3) << k
+                    << std::setfill(' ') << " " << job.scene << " " << job.label
+                    << ": " << std::setprecision(2) << std::fixed
+                    << results[k].frames / results[k].secs << " fps\n";
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double wall = time_since(t0);
+
+    std::cout << "\nBatch results:\n";
+    printl("Job", 9);
+    printr("Frames", 8);
+    printr("Time (s)");
+    printr("fps");
+    std::cout << "  Scene\n" << std::setprecision(2) << std::fixed;
+    int frames = 0;
+    for (size_t k = 0; k < jobs.size(); k++) {
+        std::ostringstream name;
+        name << "job-" << std::setfill('0') << std::setw(3) << k;
+        printl(name.str(), 9);
+        printr(results[k].frames, 8);
+        printr(results[k].secs);
+        printr(results[k].frames / results[k].secs);
+        std::cout << "  " << jobs[k].scene << " " << jobs[k].label << "\n";
+        frames += results[k].frames;
+    }
+    std::cout << "Total: " << frames << " frames in " << wall << " sec ("
+        << frames / wall << " fps)\n";
+}
@@ -0,0 +1,33 @@
+/* -*- C++ -*- */
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <string>
+#include <vector>
+
+#include "run.h"
+
+// one run of a batch: a scene file plus scene text that overrides it
+struct BatchJob {
+    std::string scene;
+    std::string overrides;      // e.g. "Explosion { size 0.04 }"
+    std::string label;          // e.g. "Explosion.size=0.04"
+};
+
+// every scene under every combination of the sweeps, each of the form
+// Block.key=value[,value...], e.g. "SimParam.niters=20,40"; the value is
+// appended to the scene as another block, so it overrides SimParam,
+// Explosion and Light keys but adds a Camera or Object
+std::vector<BatchJob> expandJobs(const std::vector<std::string> &scenes,
+    const std::vector<std::string> &sweeps);
+
+// run the jobs perDevice at a time on every OpenCL device of the default
+// platform (one at a time on each CPU sub-device); jobs on the same device
+// or sub-device share its context and program builds, and each sub-device
+// builds its own (or loads it from the binary cache). Job K writes to
+// opts.outDir/job-KKK/
+void runBatch(const std::vector<BatchJob> &jobs, unsigned perDevice,
+    RunOptions opts);
+
+#endif // __BATCH_H__
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <fstream>
+#include <glob.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <unistd.h>
+
+#include "backend.h"
+#include "scene.h"
+
+// explode-bench: runs scenes headless (nothing is written but the report)
+// at fixed grid sizes and frame counts, reports timings as JSON, and
+// compares them with an earlier report
+
+struct BenchResult {
+    std::string scene;
+    int grid;                   // longest side
+    int nx, ny, nz;             // the scene's grid, rescaled to that
+    int frames;
+    unsigned steps;
+    double startup;             // construction, including program build (s)
+    double wall;                // frames only (s)
+    double fps;
+    double cellsPerSec;         // cell updates per second of stepping
+    double raySteps;            // ray samples per second of rendering, if
+                                // every ray took all of them
+    double gridMB;
+    std::vector<std::pair<std::string, double>> kernels;   // ms/frame
+};
+
+void usage(char *prog) {
+    std::cerr << "Usage: " << prog << " [options] [scene...]\n"
+        << "  -g <n,n...>  grid sizes, longest side (default: 64,128,256)\n"
+        << "  -f <n>       frames per run (default: 20)\n"
+        << "  -o <file>    write the JSON report here (default: stdout)\n"
+        << "  -b <file>    compare with this earlier report\n"
+        << "  -T <pct>     slowdown that counts as a regression (default: 10)\n"
+        << "Scenes default to data/*.txt.\n";
+}
+
+BenchResult runOne(const std::string &fname, int grid, int frames) {
+    // same explosion every time, and nothing written; the scene keeps its
+    // shape and objects at every size
+    Scene scene(fname, "SimParam { seed 1 export none }\n");
+    scene.rescale(grid);
+
+    BenchResult r = {};
+    r.scene = fname;
+    r.grid = grid;
+    r.nx = scene.params.grid_x;
+    r.ny = scene.params.grid_y;
+    r.nz = scene.params.grid_z;
+    r.frames = frames;
+
+    Profiler prof;
+    auto t0 = time_now();
+    std::unique_ptr<Backend> sim(makeBackend(&scene, &prof));
+    r.startup = time_since(t0);
+
+    std::vector<std::unique_ptr<HostImage>> owned;
+    std::vector<HostImage *> imgs;
+    double pixels = 0.0;
+    for (auto &cam : scene.cams) {
+        owned.emplace_back(new HostImage(cam.size.s[0], cam.size.s[1]));
+        imgs.push_back(owned.back().get());
+        pixels += (double) cam.size.s[0] * cam.size.s[1];
+    }
+
+    t0 = time_now();
+    for (int i = 0; i < frames; i++) {
+        prof.setFrame(i);
+        sim->render(imgs);
+        for (auto img : imgs) {
+            img->sync();
+        }
+        sim->advance();
+    }
+    auto totals = prof.totals();
+    r.wall = time_since(t0);
+
+    BackendStats stats = sim->stats();
+    const SimParams &p = scene.params;
+    double renderSecs = 0.0, simSecs = 0.0;
+    for (auto &k : totals) {
+        r.kernels.push_back({k.name, 1e3 * k.secs / frames});
+        if (k.name == "render" || k.name == "occupancy"
+         || k.name == "lightVolume" || k.name == "readback") {
+            renderSecs += k.secs;
+        } else {
+            simSecs += k.secs;
+        }
+    }
+    r.steps = stats.steps;
+    r.fps = frames / r.wall;
+    r.cellsPerSec = (double) p.grid_x * p.grid_y * p.grid_z * stats.steps
+        / (simSecs > 0.0 ? simSecs : r.wall);
+    r.raySteps = pixels * p.samples * frames
+        / (renderSecs > 0.0 ? renderSecs : r.wall);
+    r.gridMB = stats.gridBytes / (1024.0 * 1024.0);
+    return r;
+}
+
+// one run per line, so the report is easy to diff and to read back
+void writeReport(std::ostream &out, const std::vector<BenchResult> &results) {
+    out << "{\"runs\": [\n" << std::setprecision(6);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        out << "{\"scene\": \"" << r.scene << "\", \"grid\": " << r.grid
+            << ", \"dims\": [" << r.nx << ", " << r.ny << ", " << r.nz << "]"
+            << ", \"frames\": " << r.frames << ", \"steps\": " << r.steps
+            << ", \"startup_s\": " << r.startup << ", \"wall_s\": " << r.wall
+            << ", \"fps\": " << r.fps << ", \"cells_per_s\": " << r.cellsPerSec
+            << ", \"ray_steps_per_s\": " << r.raySteps
+            << ", \"grid_mb\": " << r.gridMB << ", \"kernel_ms\": {";
+        for (size_t k = 0; k < r.kernels.size(); k++) {
+            out << (k ? ", " : "") << "\"" << r.kernels[k].first << "\": "
+                << r.kernels[k].second;
+        }
+        out << "}}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+}
+
+// the number after "key": in line, or -1
+double field(const std::string &line, const std::string &key, size_t from=0) {
+    size_t i = line.find("\"" + key + "\": ", from);
+    if (i == std::string::npos) {
+        return -1.0;
+    }
+    return atof(line.c_str() + i + key.size() + 4);
+}
+
+// reads what writeReport writes: scene and grid -> run line
+std::map<std::string, std::string> readReport(const std::string &fname) {
+    std::ifstream in(fname);
+    if (!in.is_open()) {
+        std::cerr << "Error: couldn't open baseline '" << fname << "'\n";
+        exit(1);
+    }
+    std::map<std::string, std::string> runs;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t s0 = line.find("\"scene\": \"");
+        if (s0 == std::string::npos) {
+            continue;
+        }
+        s0 += 10;
+        std::string scene = line.substr(s0, line.find('"', s0) - s0);
+        runs[scene + "@" + std::to_string((int) field(line, "grid"))] = line;
+    }
+    return runs;
+}
+
+// prints every run's fps against the baseline and the kernels that got
+// slower; returns the number of regressions
+int compare(const std::vector<BenchResult> &results,
+    const std::map<std::string, std::string> &base, double tol)
+{
+    std::cout << "\nAgainst baseline (regression: more than " << tol
+        << "% slower):\n" << std::setprecision(2) << std::fixed;
+    int regressions = 0;
+    for (auto &r : results) {
+        auto it = base.find(r.scene + "@" + std::to_string(r.grid));
+        std::cout << " " << r.scene << " @" << r.grid << ": ";
+        if (it == base.end()) {
+            std::cout << "not in baseline\n";
+            continue;
+        }
+        const std::string &line = it->second;
+        double fps = field(line, "fps");
+        double change = 100.0 * (r.fps / fps - 1.0);
+        bool slow = change < -tol;
+        regressions += slow;
+        std::cout << fps << " -> " << r.fps << " fps (" << std::showpos
+            << change << "%" << std::noshowpos << ")"
+            << (slow ? "  REGRESSION" : "") << "\n";
+
+        // kernels under 2% of a frame are too noisy to judge
+        const double minMs = 0.02 * 1e3 / fps;
+        size_t kms = line.find("\"kernel_ms\"");
+        for (auto &k : r.kernels) {
+            double ms = field(line, k.first, kms);
+            if (ms <= 0.0 || (ms < minMs && k.second < minMs)) {
+                continue;
+            }
+            double kchange = 100.0 * (k.second / ms - 1.0);
+            if (kchange > tol) {
+                regressions++;
+                std::cout << "    " << k.first << ": " << ms << " -> "
+                    << k.second << " ms/frame (+" << kchange
+                    << "%)  REGRESSION\n";
+            }
+        }
+    }
+    std::cout << regressions << " regressions\n";
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<int> grids = {64, 128, 256};
+    int frames = 20;
+    double tol = 10.0;
+    std::string outFile, baseFile;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "g:f:o:b:T:")) != -1) {
+        switch (opt) {
+        case 'g': {
+            grids.clear();
+            std::stringstream list(optarg);
+            std::string n;
+            while (std::getline(list, n, ',')) {
+                grids.push_back(atoi(n.c_str()));
+            }
+            break;
+        }
+        case 'f':
+            frames = std::max(1, atoi(optarg));
+            break;
+        case 'o':
+            outFile = optarg;
+            break;
+        case 'b':
+            baseFile = optarg;
+            break;
+        case 'T':
+            tol = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<std::string> scenes(argv + optind, argv + argc);
+    if (scenes.empty()) {
+        glob_t g;
+        if (glob("data/*.txt", 0, NULL, &g) == 0) {
+            scenes.assign(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+        }
+        globfree(&g);
+    }
+    if (scenes.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // progress goes to stderr, so stdout is just the report
+    std::streambuf *coutBuf = std::cout.rdbuf(std::cerr.rdbuf());
+    std::vector<BenchResult> results;
+    for (auto &scene : scenes) {
+        for (int grid : grids) {
+            if (grid <= 0) {
+                std::cerr << "Warning: skipping grid " << grid << "\n";
+                continue;
+            }
+            std::cerr << "== " << scene << " @" << grid << "\n";
+            results.push_back(runOne(scene, grid, frames));
+            const BenchResult &r = results.back();
+            std::cerr << r.nx << "x" << r.ny << "x" << r.nz << ": "
+                << std::setprecision(2) << std::fixed << r.fps << " fps\n";
+        }
+    }
+    std::cout.rdbuf(coutBuf);
+
+    if (outFile.empty()) {
+        writeReport(std::cout, results);
+    } else {
+        std::ofstream out(outFile);
+        writeReport(out, results);
+    }
+    if (!baseFile.empty()) {
+        // the comparison is for people; keep stdout parseable
+        std::cout.rdbuf(std::cerr.rdbuf());
+        int regressions = compare(results, readReport(baseFile), tol);
+        std::cout.rdbuf(coutBuf);
+        return regressions ? 1 : 0;
+    }
+    return 0;
+}
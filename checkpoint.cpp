@@ -0,0 +1,140 @@
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "checkpoint.h"
+#include "util.h"
+
+static const char MAGIC[8] = {'E', 'X', 'P', 'L', 'S', 'N', 'A', 'P'};
+static const uint32_t VERSION = 3;
+static const uint64_t PAGE = 4096;
+
+static const char *fieldNames[CK_NFIELDS] = {"U", "T", "B", "BN"};
+
+static uint64_t pageAlign(uint64_t n) {
+    return (n + PAGE - 1) / PAGE * PAGE;
+}
+
+static const CheckpointHeader &layout(CheckpointHeader &head) {
+    memcpy(head.magic, MAGIC, sizeof(MAGIC));
+    head.version = VERSION;
+    std::string state = randomState();
+    if (state.size() >= sizeof(head.rng)) {
+        std::cerr << "Error: random state too long for a checkpoint\n";
+        exit(1);
+    }
+    memset(head.rng, 0, sizeof(head.rng));
+    memcpy(head.rng, state.data(), state.size());
+    uint64_t cells = (uint64_t) head.nx * head.ny * head.nz;
+    uint64_t off = pageAlign(sizeof(head));
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        head.offset[f] = off;
+        off = pageAlign(off + cells * head.texelBytes[f]);
+    }
+    return head;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &fname,
+    CheckpointHeader &head) :
+    fname(fname), head(layout(head)),
+    out(fname + ".tmp", std::ios::binary), pos(0)
+{
+    if (!out) {
+        std::cerr << "Error: can't write checkpoint " << fname << ".tmp\n";
+        exit(1);
+    }
+    out.write((const char *) &head, sizeof(head));
+    pos = sizeof(head);
+}
+
+void CheckpointWriter::write(int field, const void *data) {
+    static const std::vector<char> pad(PAGE, 0);
+    uint64_t bytes = (uint64_t) head.nx * head.ny * head.nz
+        * head.texelBytes[field];
+    out.write(pad.data(), head.offset[field] - pos);
+    out.write((const char *) data, bytes);
+    pos = head.offset[field] + bytes;
+}
+
+void CheckpointWriter::close() {
+    out.close();
+    std::string tmp = fname + ".tmp";
+    if (!out || rename(tmp.c_str(), fname.c_str()) != 0) {
+        std::cerr << "Error: failed writing checkpoint " << fname << "\n";
+        exit(1);
+    }
+}
+
+Checkpoint::Checkpoint(const std::string &fname) :
+    fname(fname), map(NULL), size(0)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Error: can't open checkpoint " << fname << "\n";
+        exit(1);
+    }
+    size = st.st_size;
+    if (size < sizeof(head)) {
+        std::cerr << "Error: " << fname << " is not a checkpoint\n";
+        exit(1);
+    }
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Error: can't map checkpoint " << fname << "\n";
+        exit(1);
+    }
+
+    memcpy(&head, map, sizeof(head));
+    if (memcmp(head.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        std::cerr << "Error: " << fname << " is not a checkpoint\n";
+        exit(1);
+    }
+    if (head.version != VERSION) {
+        std::cerr << "Error: " << fname << " is checkpoint version "
+            << head.version << ", expected " << VERSION << "\n";
+        exit(1);
+    }
+    head.rng[sizeof(head.rng) - 1] = 0;
+    uint64_t cells = (uint64_t) head.nx * head.ny * head.nz;
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        if (head.offset[f] + cells * head.texelBytes[f] > size) {
+            std::cerr << "Error: checkpoint " << fname << " is truncated\n";
+            exit(1);
+        }
+    }
+}
+
+Checkpoint::~Checkpoint() {
+    munmap(map, size);
+}
+
+void Checkpoint::check(unsigned nx, unsigned ny, unsigned nz,
+    const unsigned texelBytes[CK_NFIELDS]) const
+{
+    if (head.nx != nx || head.ny != ny || head.nz != nz) {
+        std::cerr << "Error: checkpoint " << fname << " is " << head.nx << "x"
+            << head.ny << "x" << head.nz << ", scene grid is " << nx << "x"
+            << ny << "x" << nz << "\n";
+        exit(1);
+    }
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        if (head.texelBytes[f] != texelBytes[f]) {
+            std::cerr << "Error: checkpoint " << fname << " stores "
+                << fieldNames[f] << " as " << head.texelBytes[f]
+                << "-byte texels, this run uses " << texelBytes[f]
+                << " (different half setting?)\n";
+            exit(1);
+        }
+    }
+}
+
+const void *Checkpoint::grid(int field) const {
+    return (const char *) map + head.offset[field];
+}
@@ -0,0 +1,69 @@
+/* -*- C++ -*- */
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// Simulation state on disk: a fixed header followed by one raw grid per
+// field, x fastest, in the texel format the grid is stored in. Every grid
+// starts on a page boundary, so a mapped file can be handed straight to
+// enqueueWriteImage. Byte order is the host's.
+// Pressure isn't saved: every projection solves for it from zero. The
+// random generator's state is saved as it is, so a resumed run draws the
+// same explosion as the original one, and saving doesn't change it.
+enum CheckpointField {CK_U, CK_T, CK_B, CK_BN, CK_NFIELDS};
+
+struct CheckpointHeader {
+    char magic[8];              // "EXPLSNAP"
+    uint32_t version;
+    uint32_t nx, ny, nz;
+    uint32_t frame;             // frames simulated so far
+    float t;
+    uint32_t exploded;
+    char rng[8192];             // randomState(), NUL-terminated
+    uint32_t texelBytes[CK_NFIELDS];
+    uint64_t offset[CK_NFIELDS];
+};
+
+// Writes a checkpoint one grid at a time, in field order, to a temporary
+// file that is renamed into place by close(); a job killed halfway never
+// leaves a truncated checkpoint behind.
+class CheckpointWriter {
+public:
+    // fills in head.magic, version, rng and offsets
+    CheckpointWriter(const std::string &fname, CheckpointHeader &head);
+
+    void write(int field, const void *data);
+    void close();
+
+private:
+    std::string fname;
+    const CheckpointHeader head;
+    std::ofstream out;
+    uint64_t pos;
+};
+
+// a checkpoint file mapped read-only for the lifetime of the object
+class Checkpoint {
+public:
+    Checkpoint(const std::string &fname);
+    ~Checkpoint();
+
+    // exits unless the grids match the given size and texel formats
+    void check(unsigned nx, unsigned ny, unsigned nz,
+        const unsigned texelBytes[CK_NFIELDS]) const;
+
+    const void *grid(int field) const;
+
+    CheckpointHeader head;
+
+private:
+    std::string fname;
+    void *map;
+    size_t size;
+};
+
+#endif // __CHECKPOINT_H__
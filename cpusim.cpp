@@ -0,0 +1,943 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "cpusim.h"
+#include "checkpoint.h"
+#include "cie_xyz.h"
+#include "objects.h"
+
+typedef CpuSimulation::Vec3 Vec3;
+
+namespace {
+
+// must match the constants in simulate.cl
+const float
+    // general constants
+    h           = CELL_SIZE, // cell side length (m)
+    hinv        = 1.0f/h,   // cells per unit length
+    grav        = 9.8f,      // acceleration due to gravity (m/s^2)
+    cVort       = 8.0f,     // vorticity confinement
+    // heat-related
+    cBuoy       = 0.04f*h,   // buoyancy multiplier
+    cSink       = 0.3f,      // smoke sinking
+    cCooling    = 1200,     // cooling
+    tAmb        = 300,      // ambient temperature (K)
+    tMax        = 6000,     // "maximum" temperature (K)
+    // combustion-related
+    tIgnite     = 500,      // (auto)ignition temperature (K)
+    rBurn       = 4,        // fuel burn rate (amt/sec)
+    rHeat       = 2400,     // heat production rate (K/s/fuel)
+    rSmoke      = 1.0f,      // smoke/soot production rate
+    rDvg        = 18,       // extra divergence = "explosiveness"
+    rSmokeDiss  = 0.008f;    // smoke dissipation/dissappearance
+
+// must match the empty-space thresholds in simulate.cl
+const float
+    eTemp       = 1.0f,     // deviation from ambient (K)
+    eSmoke      = 1e-4f,    // smoke/soot
+    eFuel       = 1e-6f;    // fuel
+
+// must match render.cl
+const float
+    RHO_EPS     = 0.001f,
+    TX_EPS      = 0.01f;
+const int
+    nTemps = 512;       // blackbody table entries
+const float
+    maxDist = 1.7320508f,       // cube diagonal = sqrt(3)
+    absorption = 30.0f;
+
+inline Vec3 operator+(Vec3 a, Vec3 b) { return {a.x+b.x, a.y+b.y, a.z+b.z}; }
+inline Vec3 operator-(Vec3 a, Vec3 b) { return {a.x-b.x, a.y-b.y, a.z-b.z}; }
+inline Vec3 operator*(Vec3 a, float f) { return {a.x*f, a.y*f, a.z*f}; }
+inline float dot(Vec3 a, Vec3 b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+
+// like OpenCL's normalize(), zero stays zero
+inline Vec3 normalize(Vec3 a) {
+    float len = std::sqrt(dot(a, a));
+    return len > 0.0f ? a * (1.0f / len) : a;
+}
+
+inline Vec3 toVec3(cl_float3 f) {
+    return {f.s[0], f.s[1], f.s[2]};
+}
+
+// call f(i, i-1, i+1) along a row with clamp-to-edge neighbors; the interior
+// loop has no branches so it vectorizes
+template<typename F>
+inline void forRow(int n, F f) {
+    f(0, 0, std::min(1, n-1));
+    for (int i = 1; i < n-1; i++) {
+        f(i, i-1, i+1);
+    }
+    if (n > 1) {
+        f(n-1, n-2, n-1);
+    }
+}
+
+// linear filter taps along one axis, for an unnormalized coordinate
+inline void taps(float u, int &i0, float &a) {
+    u -= 0.5f;
+    float f = std::floor(u);
+    i0 = (int) f;
+    a = u - f;
+}
+
+// Planck's equation for blackbody radiation
+//  (wl=wavelength  in nm, t=temperature in K)
+float planck(float wl, float t) {
+    const float C1 = 3.74183e-16f;   // 2*pi*h*c^2
+    const float C2 = 1.4388e-2f;     // h*c/k
+
+    wl *= 1e-9f;
+    return C1 * std::pow(wl, -5.0f) / (std::exp(C2 / (wl * t)) - 1.0f) * 1e-9f;
+}
+
+}
+
+void CpuSimulation::Field3::resize(size_t n) {
+    x.assign(n, 0.0f);
+    y.assign(n, 0.0f);
+    z.assign(n, 0.0f);
+}
+
+float CpuSimulation::Sample::of(const std::vector<float> &f) const {
+    float v = 0.0f;
+    for (int i = 0; i < 8; i++) {
+        v += w[i] * f[off[i]];
+    }
+    return v;
+}
+
+CpuSimulation::CpuSimulation(Scene *sc, Profiler *prof) :
+    scene(sc), prof(prof), frameDt(sc->params.dt), dt(sc->params.dt),
+    NX(sc->params.grid_x), NY(sc->params.grid_y), NZ(sc->params.grid_z),
+    voxel(1.0f / std::max(NX, std::max(NY, NZ))), t(0.0),
+    exploded(false), gridReady(false), pool(sc->params.threads), steps(0), frames(0),
+    maxSteps(0)
+{
+    std::cout << "CPU backend: " << pool.size() << " threads\n";
+    if (sc->params.solver != SOLVER_JACOBI) {
+        std::cerr << "Warning: CPU backend only supports the Jacobi solver\n";
+    }
+    if (sc->params.sparse) {
+        std::cerr << "Warning: CPU backend always simulates the whole grid\n";
+    }
+    if (sc->params.half) {
+        std::cerr << "Warning: CPU backend always stores grids as float\n";
+    }
+
+    size_t n = (size_t) NX * NY * NZ;
+    U.resize(n);
+    U_tmp.resize(n);
+    T.resize(n);
+    T_tmp.resize(n);
+    BN.resize(n);
+    B.assign(n, 0);
+    Dvg.assign(n, 0.0f);
+    P.assign(n, 0.0f);
+    P_tmp.assign(n, 0.0f);
+    Curl.resize(n);
+    CurlMag.assign(n, 0.0f);
+    if (sc->params.lightvol) {
+        Lvol.assign(n, 0.0f);
+    }
+
+    // the starting state waits for first use, in case a checkpoint
+    // replaces it
+    initRenderer();
+}
+
+void CpuSimulation::ensureGrid() {
+    if (!gridReady) {
+        initGrid();
+        gridReady = true;
+    }
+}
+
+void CpuSimulation::advance() {
+    ensureGrid();
+    if (t > 0.2 && !exploded) {
+        addExplosion();
+        exploded = true;
+    }
+
+    // one frame: a single step, or CFL-limited steps that add up to it
+    const float end = t + frameDt;
+    unsigned n = 0;
+    do {
+        if (scene->params.cfl > 0) {
+            dt = cflStep(end - t);
+        }
+        setBounds();
+        addForces();
+        reaction();
+        project();
+        advect();
+        project();
+
+        t += dt;
+        n++;
+    } while (scene->params.cfl > 0 && end - t > 1e-3f * frameDt);
+    t = end;
+    steps += n;
+    frames++;
+    maxSteps = std::max(maxSteps, n);
+}
+
+float CpuSimulation::maxSpeed() {
+    std::vector<float> slabMax(NZ, 0.0f);
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        for (int k = z0; k < z1; k++) {
+            float m = 0.0f;
+            for (size_t c = idx(0, 0, k); c < idx(0, 0, k+1); c++) {
+                m = std::max(m, U.x[c]*U.x[c] + U.y[c]*U.y[c] + U.z[c]*U.z[c]);
+            }
+            slabMax[k] = m;
+        }
+    });
+    return std::sqrt(*std::max_element(slabMax.begin(), slabMax.end()));
+}
+
+float CpuSimulation::cflStep(float remaining) {
+    // fewest equal steps over the rest of the frame that stay under the
+    // CFL target; the explosion is what pushes this up
+    float cells = maxSpeed() * remaining * hinv;
+    int n = (int) std::ceil(cells / scene->params.cfl);
+    n = std::min(std::max(n, 1), scene->params.maxsubsteps);
+    return remaining / n;
+}
+
+float CpuSimulation::getT() {
+    return t;
+}
+
+void CpuSimulation::render(const std::vector<HostImage *> &imgs) {
+    ensureGrid();
+    auto t0 = time_now();
+    if (scene->params.lightvol) {
+        lightVolume();
+    }
+    for (size_t v = 0; v < imgs.size(); v++) {
+        HostImage &img = *imgs[v];
+        pool.parallelFor(img.h, [&](int y0, int y1) {
+            renderRows(scene->cams[v], img, y0, y1);
+        });
+    }
+    profile(RENDER, t0);
+}
+
+void CpuSimulation::exportVolume(VolumeFrame &vol) {
+    ensureGrid();
+    // same bricks as the OpenCL backend: 8x8x4, shrunk to fit small grids
+    int bx = 8, by = 8, bz = 4;
+    while (bx > NX) bx /= 2;
+    while (by > NY) by /= 2;
+    while (bz > NZ) bz /= 2;
+    vol.nx = NX;
+    vol.ny = NY;
+    vol.nz = NZ;
+    vol.bx = bx;
+    vol.by = by;
+    vol.bz = bz;
+    vol.channels = scene->params.exports;
+    vol.t = t;
+    vol.bricks.clear();
+    vol.data.clear();
+
+    const std::vector<float> *chans[3] = {&T.x, &T.y, &T.z};
+    for (int k0 = 0; k0 < NZ; k0 += bz)
+    for (int j0 = 0; j0 < NY; j0 += by)
+    for (int i0 = 0; i0 < NX; i0 += bx) {
+        bool active = false;
+        for (int k = k0; k < std::min(k0 + bz, NZ) && !active; k++)
+        for (int j = j0; j < std::min(j0 + by, NY) && !active; j++)
+        for (int i = i0; i < std::min(i0 + bx, NX) && !active; i++) {
+            size_t c = idx(i, j, k);
+            active = B[c] == 0 && (std::abs(T.x[c] - tAmb) > eTemp
+                || T.y[c] > eSmoke || T.z[c] > eFuel);
+        }
+        if (!active) {
+            continue;
+        }
+
+        // texels past the far faces repeat the edge ones, as the device's
+        // clamped reads do
+        vol.bricks.push_back({{i0, j0, k0, 0}});
+        for (int k = k0; k < k0 + bz; k++)
+        for (int j = j0; j < j0 + by; j++)
+        for (int i = i0; i < i0 + bx; i++) {
+            size_t c = idx(std::min(i, NX-1), std::min(j, NY-1),
+                std::min(k, NZ-1));
+            for (int ch = 0; ch < 3; ch++) {
+                if (vol.channels & (1 << ch)) {
+                    vol.data.push_back((*chans[ch])[c]);
+                }
+            }
+        }
+    }
+}
+
+void CpuSimulation::loadVolume(const VolumeFrame &vol) {
+    ensureGrid();
+    if (vol.nx != (unsigned) NX || vol.ny != (unsigned) NY
+     || vol.nz != (unsigned) NZ) {
+        std::cerr << "Error: volume is " << vol.nx << "x" << vol.ny << "x"
+            << vol.nz << ", expected " << NX << "x" << NY << "x" << NZ << "\n";
+        exit(1);
+    }
+
+    // bricks that weren't exported are empty
+    const size_t n = (size_t) NX * NY * NZ;
+    for (size_t c = 0; c < n; c++) {
+        T.x[c] = B[c] == 0 ? tAmb : 0.0f;
+        T.y[c] = T.z[c] = 0.0f;
+    }
+
+    std::vector<float> *chans[3] = {&T.x, &T.y, &T.z};
+    const float *in = vol.data.data();
+    for (auto &b : vol.bricks) {
+        for (int k = b.s[2]; k < b.s[2] + (int) vol.bz; k++)
+        for (int j = b.s[1]; j < b.s[1] + (int) vol.by; j++)
+        for (int i = b.s[0]; i < b.s[0] + (int) vol.bx; i++) {
+            const bool inside = i < NX && j < NY && k < NZ;
+            for (int ch = 0; ch < 3; ch++) {
+                if (vol.channels & (1 << ch)) {
+                    float v = *in++;
+                    if (inside) {
+                        (*chans[ch])[idx(i, j, k)] = v;
+                    }
+                }
+            }
+        }
+    }
+    t = vol.t;
+}
+
+void CpuSimulation::initGrid() {
+    const bool walls = scene->params.walls;
+    const ObjectBins bins = binObjects(scene->objects, NX, NY, NZ);
+
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++)
+        for (int i = 0; i < NX; i++) {
+            unsigned char b = 0;
+            if (walls) {
+                if (i == 0 || i == NX-1 || j == 0 || j == NY-1 || k == 0 || k == NZ-1) {
+                    b = 2;
+                }
+            }
+
+            // only the objects binned here
+            int bi = ((k / OBJ_BIN) * bins.ny + j / OBJ_BIN) * bins.nx
+                + i / OBJ_BIN;
+            for (cl_uint o = bins.index[bi]; o < bins.index[bi+1]; o++) {
+                if (objectContains(scene->objects[bins.index[o]], i, j, k)) {
+                    b = 1;
+                    break;
+                }
+            }
+
+            B[idx(i, j, k)] = b;
+        }
+    });
+
+    // and the object normals (see gen_normals)
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++)
+        for (int i = 0; i < NX; i++) {
+            size_t c = idx(i, j, k);
+            if (B[c] != 1) {
+                BN.x[c] = BN.y[c] = BN.z[c] = 1.0f;
+                continue;
+            }
+
+            auto open = [&](int a, int b, int d) {
+                return B[idx(clampX(a), clampY(b), clampZ(d))] == 0 ? 1.0f : 0.0f;
+            };
+            Vec3 n = {
+                open(i+1, j, k) - open(i-1, j, k),
+                open(i, j+1, k) - open(i, j-1, k),
+                open(i, j, k+1) - open(i, j, k-1),
+            };
+            n = normalize(n);
+            BN.x[c] = n.x;
+            BN.y[c] = n.y;
+            BN.z[c] = n.z;
+        }
+    });
+}
+
+void CpuSimulation::initRenderer() {
+    // pre-compute blackbody spectra (see gen_blackbody)
+    bbspec.resize(nTemps);
+    for (int p = 0; p < nTemps; p++) {
+        float temp = tMax * (float) p / nTemps;
+        cl_float4 &out = bbspec[p];
+        if (temp < 500.0f) {
+            out.s[0] = out.s[1] = out.s[2] = out.s[3] = 0.0f;
+            continue;
+        }
+
+        float xyz[3] = {0, 0, 0};
+        float wl = 380;
+        for (int i = 0; i < N_CIE; i++) {
+            float pl = planck(wl, temp);
+            for (int c = 0; c < 3; c++) {
+                xyz[c] += cie_coeffs[i][c] * pl;
+            }
+            wl += 5.0f;
+        }
+
+        const float sRGB[3][3] = {
+            { 3.2404542f, -1.5371385f, -0.4985314f},
+            {-0.9692660f,  1.8760108f,  0.0415560f},
+            { 0.0556434f, -0.2040259f,  1.0572252f}
+        };
+        float rgb[3];
+        for (int c = 0; c < 3; c++) {
+            rgb[c] = sRGB[c][0] * xyz[0] + sRGB[c][1] * xyz[1] + sRGB[c][2] * xyz[2];
+        }
+
+        float lo = std::min(0.0f, std::min(rgb[0], std::min(rgb[1], rgb[2])));
+        for (int c = 0; c < 3; c++) {
+            rgb[c] -= lo;
+        }
+        float rgbMax = std::max(rgb[0], std::max(rgb[1], rgb[2]));
+        for (int c = 0; c < 3; c++) {
+            out.s[c] = rgbMax > 0.0f ? rgb[c] / rgbMax : rgb[c];
+        }
+        out.s[3] = std::sqrt(std::sqrt(xyz[0]*xyz[0] + xyz[1]*xyz[1] + xyz[2]*xyz[2]));
+    }
+}
+
+void CpuSimulation::advect() {
+    auto t0 = time_now();
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        const float s = dt * hinv;
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++)
+        for (int i = 0; i < NX; i++) {
+            size_t c = idx(i, j, k);
+            Vec3 p0 = {
+                i + 0.5f - s * U.x[c],
+                j + 0.5f - s * U.y[c],
+                k + 0.5f - s * U.z[c],
+            };
+            Sample sm = sampleClamped(p0);
+            U_tmp.x[c] = sm.of(U.x);
+            U_tmp.y[c] = sm.of(U.y);
+            U_tmp.z[c] = sm.of(U.z);
+            T_tmp.x[c] = sm.of(T.x);
+            T_tmp.y[c] = sm.of(T.y);
+            T_tmp.z[c] = sm.of(T.z);
+        }
+    });
+    profile(ADVECT, t0);
+
+    std::swap(U, U_tmp);
+    std::swap(T, T_tmp);
+}
+
+void CpuSimulation::curl() {
+    auto t0 = time_now();
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        const float *ux = U.x.data(), *uy = U.y.data(), *uz = U.z.data();
+        float *cx = Curl.x.data(), *cy = Curl.y.data(), *cz = Curl.z.data(),
+              *cm = CurlMag.data();
+
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++) {
+            size_t r = idx(0, j, k),
+                   ym = idx(0, clampY(j-1), k), yp = idx(0, clampY(j+1), k),
+                   zm = idx(0, j, clampZ(k-1)), zp = idx(0, j, clampZ(k+1));
+
+            forRow(NX, [&](int i, int im, int ip) {
+                float x = (uz[yp+i] - uz[ym+i] - uy[zp+i] + uy[zm+i]) * 0.5f * hinv,
+                      y = (ux[zp+i] - ux[zm+i] - uz[r+ip] + uz[r+im]) * 0.5f * hinv,
+                      z = (uy[r+ip] - uy[r+im] - ux[yp+i] + ux[ym+i]) * 0.5f * hinv;
+                cx[r+i] = x;
+                cy[r+i] = y;
+                cz[r+i] = z;
+                cm[r+i] = std::sqrt(x*x + y*y + z*z);
+            });
+        }
+    });
+    profile(CURL, t0);
+}
+
+void CpuSimulation::addForces() {
+    // compute curl for vorticity confinement
+    curl();
+
+    auto t0 = time_now();
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        const float *cm = CurlMag.data();
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++) {
+            size_t r = idx(0, j, k),
+                   ym = idx(0, clampY(j-1), k), yp = idx(0, clampY(j+1), k),
+                   zm = idx(0, j, clampZ(k-1)), zp = idx(0, j, clampZ(k+1));
+
+            forRow(NX, [&](int i, int im, int ip) {
+                size_t c = r + i;
+
+                // buoyancy - hot air rises, smoke sinks
+                float fy = cBuoy * (T.x[c] - tAmb) - cSink * grav * T.y[c];
+
+                // vorticity confinement
+                Vec3 eta = {
+                    cm[r+ip] - cm[r+im],
+                    cm[yp+i] - cm[ym+i],
+                    cm[zp+i] - cm[zm+i],
+                };
+                eta = normalize(eta * (0.5f * hinv));
+                Vec3 w = {Curl.x[c], Curl.y[c], Curl.z[c]};
+                Vec3 f = {
+                    eta.y * w.z - eta.z * w.y,
+                    eta.z * w.x - eta.x * w.z,
+                    eta.x * w.y - eta.y * w.x,
+                };
+                f = f * (cVort * h);
+                f.y += fy;
+
+                U.x[c] += dt * f.x;
+                U.y[c] += dt * f.y;
+                U.z[c] += dt * f.z;
+            });
+        }
+    });
+    profile(ADD_FORCES, t0);
+}
+
+void CpuSimulation::reaction() {
+    auto t0 = time_now();
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        float *tx = T.x.data(), *ty = T.y.data(), *tz = T.z.data(),
+              *dvg = Dvg.data();
+        size_t a = idx(0, 0, z0), b = idx(0, 0, z1);
+        for (size_t c = a; c < b; c++) {
+            // cooling
+            float r = (tx[c] - tAmb) / (tMax - tAmb);
+            float temp = std::max(tx[c] - cCooling * (r*r)*(r*r), tAmb);
+            float smoke = ty[c], fuel = tz[c];
+
+            // combustion
+            float d = 0.0f;
+            if (temp > tIgnite && fuel > 0.0f) {
+                float df = std::min(fuel, rBurn * dt);
+                temp += rHeat * df;
+                smoke += rSmoke * df;
+                fuel -= df;
+                d = rDvg * df;
+            }
+
+            tx[c] = temp;
+            ty[c] = smoke * (1.0f - rSmokeDiss);
+            tz[c] = fuel;
+            dvg[c] = d;
+        }
+    });
+    profile(REACTION, t0);
+}
+
+void CpuSimulation::project() {
+    // compute Dvg += div(U), zero out P
+    auto t0 = time_now();
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        const float *ux = U.x.data(), *uy = U.y.data(), *uz = U.z.data();
+        float *dvg = Dvg.data(), *p = P.data();
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++) {
+            size_t r = idx(0, j, k),
+                   ym = idx(0, clampY(j-1), k), yp = idx(0, clampY(j+1), k),
+                   zm = idx(0, j, clampZ(k-1)), zp = idx(0, j, clampZ(k+1));
+
+            forRow(NX, [&](int i, int im, int ip) {
+                float d = -0.5f * h *
+                     ((ux[r+ip] - ux[r+im])
+                    + (uy[yp+i] - uy[ym+i])
+                    + (uz[zp+i] - uz[zm+i]));
+                dvg[r+i] += d;
+                p[r+i] = 0.0f;
+            });
+        }
+    });
+    profile(DIVERGENCE, t0);
+
+    // solve laplace(P) = div(U) for P
+    const int niters = scene->params.niters;
+    for (int it = 0; it < niters; it++) {
+        t0 = time_now();
+        pool.parallelFor(NZ, [&](int z0, int z1) {
+            const float *p = P.data(), *dvg = Dvg.data();
+            float *out = P_tmp.data();
+            for (int k = z0; k < z1; k++)
+            for (int j = 0; j < NY; j++) {
+                size_t r = idx(0, j, k),
+                       ym = idx(0, clampY(j-1), k), yp = idx(0, clampY(j+1), k),
+                       zm = idx(0, j, clampZ(k-1)), zp = idx(0, j, clampZ(k+1));
+
+                forRow(NX, [&](int i, int im, int ip) {
+                    out[r+i] = ((p[r+ip] + p[r+im]
+                               + p[yp+i] + p[ym+i]
+                               + p[zp+i] + p[zm+i]) + dvg[r+i]) / 6.0f;
+                });
+            }
+        });
+        profile(JACOBI, t0);
+        std::swap(P, P_tmp);
+    }
+
+    // compute new U' = U - grad(P)
+    t0 = time_now();
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        const float *p = P.data();
+        float *ux = U.x.data(), *uy = U.y.data(), *uz = U.z.data();
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++) {
+            size_t r = idx(0, j, k),
+                   ym = idx(0, clampY(j-1), k), yp = idx(0, clampY(j+1), k),
+                   zm = idx(0, j, clampZ(k-1)), zp = idx(0, j, clampZ(k+1));
+
+            forRow(NX, [&](int i, int im, int ip) {
+                ux[r+i] -= 0.5f * hinv * (p[r+ip] - p[r+im]);
+                uy[r+i] -= 0.5f * hinv * (p[yp+i] - p[ym+i]);
+                uz[r+i] -= 0.5f * hinv * (p[zp+i] - p[zm+i]);
+            });
+        }
+    });
+    profile(PROJECT, t0);
+}
+
+void CpuSimulation::setBounds() {
+    auto t0 = time_now();
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        size_t a = idx(0, 0, z0), b = idx(0, 0, z1);
+        for (size_t c = a; c < b; c++) {
+            bool solid = B[c] != 0;
+            U.x[c] = solid ? 0.0f : U.x[c];
+            U.y[c] = solid ? 0.0f : U.y[c];
+            U.z[c] = solid ? 0.0f : U.z[c];
+            T.x[c] = solid ? 0.0f : T.x[c];
+            T.y[c] = solid ? 0.0f : T.y[c];
+            T.z[c] = solid ? 0.0f : T.z[c];
+        }
+    });
+    profile(SET_BOUNDS, t0);
+}
+
+void CpuSimulation::addExplosion() {
+    const float spread = 3.5;
+
+    Explosion ex = scene->explosion;
+    float volDiv = std::pow(ex.subex, 1.0/3.0f);
+    for (unsigned e = 0; e < ex.subex; e++) {
+        Vec3 loc = {
+            ex.pos.s[0] + randf() * ex.size * spread,
+            ex.pos.s[1] + randf() * ex.size * spread,
+            ex.pos.s[2] + randf() * ex.size * spread,
+        };
+        float size = (ex.size + 0.4 * ex.size * randf()) / volDiv;
+
+        // explosion positions are world coords
+        pool.parallelFor(NZ, [&](int z0, int z1) {
+            for (int k = z0; k < z1; k++)
+            for (int j = 0; j < NY; j++)
+            for (int i = 0; i < NX; i++) {
+                Vec3 d = Vec3{(float) i, (float) j, (float) k} * voxel - loc;
+                if (std::sqrt(dot(d, d)) < size) {
+                    size_t c = idx(i, j, k);
+                    T.x[c] = 3000;
+                    T.y[c] = 0;
+                    T.z[c] = 1.25f;
+                }
+            }
+        });
+    }
+}
+
+void CpuSimulation::renderRows(const Camera &cam, HostImage &img, int y0,
+    int y1)
+{
+    const Light &light = scene->light;
+    const Vec3 camPos = toVec3(cam.pos),
+               lightPos = toVec3(light.pos);
+    const Vec3 ext = Vec3{(float) NX, (float) NY, (float) NZ} * voxel;
+    const int nsamp = scene->params.samples;
+    const float ds = maxDist / nsamp;       // main ray step size
+
+    // the image plane is the domain's front face, with square pixels
+    const float s = std::max(ext.x / img.w, ext.y / img.h);
+    const float ox = 0.5f * (ext.x - s * img.w),
+                oy = 0.5f * (ext.y - s * img.h);
+
+    for (int y = y0; y < y1; y++)
+    for (int x = 0; x < img.w; x++) {
+        Vec3 pos = {ox + s * x, oy + s * y, 0};
+        Vec3 dir = normalize(pos - camPos) * ds;
+
+        float tx = 1.0f;            // transmittance along ray
+        Vec3 Lo = {0, 0, 0};        // total light output from ray
+
+        Vec3 bg = {0.5f, 0.5f, 0.9f};
+        for (int i = 0; i < nsamp; i++) {
+            Sample sm;
+            if (sampleSolid(pos)) {
+                float Li = lightAt(pos);
+
+                // diffuse reflection
+                Vec3 L = normalize(lightPos - pos);
+                Vec3 n = {0, 0, 0};
+                if (sampleBorder(pos, sm)) {
+                    n = {sm.of(BN.x), sm.of(BN.y), sm.of(BN.z)};
+                }
+                Vec3 C = {0.28f, 0.36f, 0.41f};
+                bg = C * (dot(L, n) * Li * 0.8f);
+                break;
+            }
+
+            if (sampleBorder(pos, sm)) {
+                float rho = sm.of(T.y);
+                if (rho > RHO_EPS) {
+                    tx *= 1.0f - rho * ds * absorption;
+                    if (tx < TX_EPS) break;
+
+                    // incident light from light source (attenuated)
+                    float Li = lightAt(pos);
+
+                    // blackbody radiation
+                    cl_float4 bb = getBlackbody(sm.of(T.x));
+                    Vec3 Le = Vec3{bb.s[0], bb.s[1], bb.s[2]} * (bb.s[3] * 0.7f);
+
+                    Lo = Lo + (Vec3{Li, Li, Li} + Le * tx) * (rho * ds);
+                }
+            }
+
+            pos = pos + dir;
+
+            // terminate if out-of-bounds
+            if (pos.x < 0.0f || pos.x > ext.x
+             || pos.y < 0.0f || pos.y > ext.y
+             || pos.z < 0.0f || pos.z > ext.z) {
+                break;
+            }
+        }
+
+        Vec3 color = (Lo + bg * tx) * 255.0f;
+        char *px = img.data + 4 * ((img.h-1-y) * img.w + x);
+        px[0] = (unsigned char) std::min(std::max(color.x, 0.0f), 255.0f);
+        px[1] = (unsigned char) std::min(std::max(color.y, 0.0f), 255.0f);
+        px[2] = (unsigned char) std::min(std::max(color.z, 0.0f), 255.0f);
+        px[3] = (unsigned char) 255;
+    }
+}
+
+void CpuSimulation::lightVolume() {
+    pool.parallelFor(NZ, [&](int z0, int z1) {
+        for (int k = z0; k < z1; k++)
+        for (int j = 0; j < NY; j++)
+        for (int i = 0; i < NX; i++) {
+            Vec3 p = Vec3{i + 0.5f, j + 0.5f, k + 0.5f} * voxel;
+            Lvol[idx(i, j, k)] = traceToLight(p);
+        }
+    });
+}
+
+float CpuSimulation::lightAt(Vec3 pos) {
+    if (scene->params.lightvol) {
+        return sampleClamped(pos * (1.0f / voxel)).of(Lvol);
+    }
+    return traceToLight(pos);
+}
+
+float CpuSimulation::traceToLight(Vec3 pos0) {
+    const Light &light = scene->light;
+    const int nlsamp = scene->params.lightsamples;
+    const float dsl = maxDist / nlsamp;     // light ray step size
+    Vec3 dir = normalize(toVec3(light.pos) - pos0) * dsl;
+    Vec3 pos = pos0 + dir;
+    float tx = 1.0f;
+
+    for (int i = 0; i < nlsamp; i++) {
+        Sample sm;
+        float rho = sampleBorder(pos, sm) ? sm.of(T.y) : 0.0f;
+        tx *= 1.0f - rho * dsl * absorption;
+        if (tx < TX_EPS) break;
+
+        pos = pos + dir;
+    }
+
+    return tx * light.intensity;
+}
+
+// samp_ni: world coords, nearest, zero border
+bool CpuSimulation::sampleSolid(Vec3 p) {
+    int i = (int) std::floor(p.x / voxel),
+        j = (int) std::floor(p.y / voxel),
+        k = (int) std::floor(p.z / voxel);
+    if (i < 0 || i >= NX || j < 0 || j >= NY || k < 0 || k >= NZ) {
+        return false;
+    }
+    return B[idx(i, j, k)] == 1;
+}
+
+// samp_f: unnormalized coords, linear, clamp to edge
+CpuSimulation::Sample CpuSimulation::sampleClamped(Vec3 p) {
+    int i, j, k;
+    float a, b, c;
+    taps(p.x, i, a);
+    taps(p.y, j, b);
+    taps(p.z, k, c);
+
+    int is[2] = {clampX(i), clampX(i+1)},
+        js[2] = {clampY(j), clampY(j+1)},
+        ks[2] = {clampZ(k), clampZ(k+1)};
+    float wi[2] = {1-a, a}, wj[2] = {1-b, b}, wk[2] = {1-c, c};
+
+    Sample s;
+    for (int n = 0; n < 8; n++) {
+        int x = n & 1, y = (n >> 1) & 1, z = n >> 2;
+        s.off[n] = idx(is[x], js[y], ks[z]);
+        s.w[n] = wi[x] * wj[y] * wk[z];
+    }
+    return s;
+}
+
+// samp_n: world coords, linear, zero border; false if all taps are
+// outside the grid
+bool CpuSimulation::sampleBorder(Vec3 p, Sample &s) {
+    int i, j, k;
+    float a, b, c;
+    taps(p.x / voxel, i, a);
+    taps(p.y / voxel, j, b);
+    taps(p.z / voxel, k, c);
+    if (i < -1 || i >= NX || j < -1 || j >= NY || k < -1 || k >= NZ) {
+        return false;
+    }
+
+    int is[2] = {i, i+1}, js[2] = {j, j+1}, ks[2] = {k, k+1};
+    float wi[2] = {1-a, a}, wj[2] = {1-b, b}, wk[2] = {1-c, c};
+
+    for (int n = 0; n < 8; n++) {
+        int x = n & 1, y = (n >> 1) & 1, z = n >> 2;
+        if (is[x] < 0 || is[x] >= NX || js[y] < 0 || js[y] >= NY
+         || ks[z] < 0 || ks[z] >= NZ) {
+            // border texel: contributes zero
+            s.off[n] = 0;
+            s.w[n] = 0.0f;
+        } else {
+            s.off[n] = idx(is[x], js[y], ks[z]);
+            s.w[n] = wi[x] * wj[y] * wk[z];
+        }
+    }
+    return true;
+}
+
+cl_float4 CpuSimulation::getBlackbody(float temp) {
+    // samp_n along x; the kernel reads row 0 at v=0, which the sampler
+    // blends half-and-half with the zero border
+    int i;
+    float a;
+    taps(temp / tMax * nTemps, i, a);
+
+    cl_float4 v;
+    for (int c = 0; c < 4; c++) {
+        float lo = (i >= 0 && i < nTemps) ? bbspec[i].s[c] : 0.0f,
+              hi = (i+1 >= 0 && i+1 < nTemps) ? bbspec[i+1].s[c] : 0.0f;
+        v.s[c] = 0.5f * ((1-a) * lo + a * hi);
+    }
+    return v;
+}
+
+void CpuSimulation::profile(int pk, TimePoint &t0) {
+    static const std::string kernelNames[_LAST] = { "advect", "curl",
+        "addForces", "reaction", "divergence", "jacobi", "project",
+        "setBounds", "render"};
+
+    if (prof) {
+        prof->hostSpan(kernelNames[pk], t0, time_now());
+    }
+}
+
+// checkpoints use the OpenCL backend's float texels (RGBA float vectors,
+// R uint8 boundaries), so files move between backends
+void CpuSimulation::saveCheckpoint(const std::string &fname, int frame) {
+    ensureGrid();
+    const size_t n = (size_t) NX * NY * NZ;
+    CheckpointHeader head = {};
+    head.nx = NX;
+    head.ny = NY;
+    head.nz = NZ;
+    head.frame = frame;
+    head.t = t;
+    head.exploded = exploded;
+    const unsigned texelBytes[CK_NFIELDS] = {16, 16, 1, 16};
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        head.texelBytes[f] = texelBytes[f];
+    }
+
+    CheckpointWriter out(fname, head);
+    const Field3 *vecs[CK_NFIELDS] = {&U, &T, NULL, &BN};
+    std::vector<cl_float4> v(n);
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        if (f == CK_B) {
+            out.write(f, B.data());
+        } else {
+            const Field3 &F = *vecs[f];
+            for (size_t i = 0; i < n; i++) {
+                v[i] = {{F.x[i], F.y[i], F.z[i], 0.0f}};
+            }
+            out.write(f, v.data());
+        }
+    }
+    out.close();
+}
+
+int CpuSimulation::loadCheckpoint(const std::string &fname) {
+    const size_t n = (size_t) NX * NY * NZ;
+    const unsigned texelBytes[CK_NFIELDS] = {16, 16, 1, 16};
+    Checkpoint ck(fname);
+    ck.check(NX, NY, NZ, texelBytes);
+
+    Field3 *vecs[CK_NFIELDS] = {&U, &T, NULL, &BN};
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        if (f == CK_B) {
+            auto b = (const unsigned char *) ck.grid(f);
+            B.assign(b, b + n);
+        } else {
+            auto v = (const cl_float4 *) ck.grid(f);
+            Field3 &F = *vecs[f];
+            for (size_t i = 0; i < n; i++) {
+                F.x[i] = v[i].s[0];
+                F.y[i] = v[i].s[1];
+                F.z[i] = v[i].s[2];
+            }
+        }
+    }
+    t = ck.head.t;
+    exploded = ck.head.exploded;
+    setRandomState(ck.head.rng);
+    gridReady = true;
+    return ck.head.frame;
+}
+
+BackendStats CpuSimulation::stats() {
+    size_t bytes = B.size() + sizeof(float) * (Dvg.size() + P.size()
+        + P_tmp.size() + CurlMag.size() + Lvol.size());
+    for (const Field3 *f : {&U, &U_tmp, &T, &T_tmp, &BN, &Curl}) {
+        bytes += sizeof(float) * 3 * f->x.size();
+    }
+    return {steps, bytes};
+}
+
+void CpuSimulation::dumpProfiling() {
+    if (prof && scene->params.cfl > 0 && frames) {
+        std::cout << "\nAdaptive dt: " << std::setprecision(2)
+            << (double) steps / frames << " steps/frame on average, "
+            << maxSteps << " at most\n";
+    }
+}
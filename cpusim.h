@@ -0,0 +1,125 @@
+/* -*- C++ -*- */
+
+#ifndef __CPUSIM_H__
+#define __CPUSIM_H__
+
+#include <vector>
+
+#include "backend.h"
+#include "scene.h"
+#include "threadpool.h"
+#include "util.h"
+
+// Native C++ port of simulate.cl/render.cl, for machines without a GPU.
+// Fields are flat structure-of-arrays grids, x fastest; work is split into
+// z-slabs across a thread pool and the x loops are left for the compiler to
+// vectorize.
+class CpuSimulation : public Backend {
+public:
+    CpuSimulation(Scene *sc, Profiler *prof=NULL);
+
+    void advance();
+    float getT();
+
+    void render(const std::vector<HostImage *> &imgs);
+    void exportVolume(VolumeFrame &vol);
+    void loadVolume(const VolumeFrame &vol);
+
+    void dumpProfiling();
+    BackendStats stats();
+
+    void saveCheckpoint(const std::string &fname, int frame);
+    int loadCheckpoint(const std::string &fname);
+
+    struct Vec3 {
+        float x, y, z;
+    };
+
+private:
+    struct Field3 {
+        std::vector<float> x, y, z;
+        void resize(size_t n);
+    };
+
+    // trilinear filter footprint: 8 texel offsets and weights
+    struct Sample {
+        size_t off[8];
+        float w[8];
+        float of(const std::vector<float> &f) const;
+    };
+
+    // initialization; the grid's starting state (walls, objects and their
+    // normals) is set up on first use, unless a checkpoint replaced it
+    void ensureGrid();
+    void initGrid();
+    void initRenderer();
+
+    // fluid dynamics
+    void advect();
+    void curl();
+    void addForces();
+    void reaction();
+    void project();
+    void setBounds();
+    void addExplosion();
+
+    // adaptive time step
+    float maxSpeed();
+    float cflStep(float remaining);
+
+    // rendering
+    void renderRows(const Camera &cam, HostImage &img, int y0, int y1);
+    void lightVolume();
+    float lightAt(Vec3 pos);
+    float traceToLight(Vec3 pos0);
+    bool sampleSolid(Vec3 p);
+    Sample sampleClamped(Vec3 p);
+    bool sampleBorder(Vec3 p, Sample &s);
+    cl_float4 getBlackbody(float temp);
+
+    // helper functions
+    size_t idx(int i, int j, int k) const {
+        return ((size_t) k * NY + j) * NX + i;
+    }
+    static int clampTo(int i, int n) {
+        return i < 0 ? 0 : (i >= n ? n-1 : i);
+    }
+    int clampX(int i) const { return clampTo(i, NX); }
+    int clampY(int j) const { return clampTo(j, NY); }
+    int clampZ(int k) const { return clampTo(k, NZ); }
+    void profile(int pk, TimePoint &t0);
+
+    const Scene *scene;
+    Profiler *const prof;
+    const float frameDt;        // time between frames
+    float dt;                   // current step size
+    const int NX, NY, NZ;
+    const float voxel;          // cell size in world coords (longest side = 1)
+    float t;
+    bool exploded;
+    bool gridReady;
+
+    ThreadPool pool;
+
+    // state variables
+    Field3 U, U_tmp,            // velocity vector field
+           T, T_tmp,            // (temperature, smoke/soot, fuel)
+           BN;                  // boundary normals
+    std::vector<unsigned char> B;
+
+    // intermediates
+    std::vector<float> Dvg, P, P_tmp;
+    Field3 Curl;
+    std::vector<float> CurlMag;
+    std::vector<float> Lvol;    // light reaching each voxel, if lightvol
+
+    std::vector<cl_float4> bbspec;
+
+    unsigned steps, frames, maxSteps;   // steps per frame, with adaptive dt
+
+    // profiling
+    enum {ADVECT, CURL, ADD_FORCES, REACTION, DIVERGENCE, JACOBI, PROJECT,
+        SET_BOUNDS, RENDER, _LAST};
+};
+
+#endif // __CPUSIM_H__
@@ -0,0 +1,238 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "clerror.h"
+#include "util.h"
+
+// src followed by every file it #includes, so an edit to any of them
+// changes the cache key
+static std::string withIncludes(const std::string &src) {
+    std::string all = src;
+    std::istringstream lines(src);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t q0 = line.find('"'), q1 = line.rfind('"');
+        if (line.compare(0, 8, "#include") == 0 && q0 < q1) {
+            all += slurpFile(line.substr(q0 + 1, q1 - q0 - 1));
+        }
+    }
+    return all;
+}
+
+std::string cacheDir() {
+    std::string base;
+    if (const char *xdg = getenv("XDG_CACHE_HOME")) {
+        base = xdg;
+    } else if (const char *home = getenv("HOME")) {
+        base = std::string(home) + "/.cache";
+    } else {
+        return "";
+    }
+    mkdir(base.c_str(), 0755);
+    mkdir((base + "/explode").c_str(), 0755);
+    return base + "/explode";
+}
+
+std::string deviceIdentity(const cl::Device &device) {
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    return platform.getInfo<CL_PLATFORM_NAME>() + "\n"
+        + platform.getInfo<CL_PLATFORM_VERSION>() + "\n"
+        + device.getInfo<CL_DEVICE_VENDOR>() + "\n"
+        + device.getInfo<CL_DEVICE_NAME>() + "\n"
+        + device.getInfo<CL_DEVICE_VERSION>() + "\n"
+        + device.getInfo<CL_DRIVER_VERSION>();
+}
+
+// everything a compiled binary depends on
+static std::string cacheKey(const cl::Device &device, const std::string &sources,
+    const std::string &options)
+{
+    return deviceIdentity(device) + "\n" + options + "\n" + sources;
+}
+
+uint64_t hashKey(const std::string &key) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : key) {
+        h = (h ^ c) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// a cache file is the key's length, the key, then the program binary
+static bool loadBinary(const ClDevice &dev, cl::Program &program,
+    const std::string &fname, const std::string &key,
+    const std::string &options)
+{
+    std::ifstream in(fname, std::ios::binary);
+    uint64_t keyLen = 0;
+    if (!in.read((char*) &keyLen, sizeof(keyLen)) || keyLen != key.size()) {
+        return false;
+    }
+    std::string fileKey(keyLen, '\0');
+    if (!in.read(&fileKey[0], keyLen) || fileKey != key) {
+        return false;
+    }
+    std::string binary((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+    if (binary.empty()) {
+        return false;
+    }
+
+    try {
+        cl::Program::Binaries bins(1, std::make_pair(binary.data(), binary.size()));
+        program = cl::Program(dev.context, {dev.device}, bins);
+        program.build(options.c_str());
+    } catch (cl::Error err) {
+        std::cerr << "Warning: cached OpenCL binary " << fname
+            << " didn't load (" << getCLError(err.err()) << "), rebuilding\n";
+        return false;
+    }
+    return true;
+}
+
+static void saveBinary(const cl::Program &program, const std::string &fname,
+    const std::string &key)
+{
+    size_t size = 0;
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size),
+            &size, NULL) != CL_SUCCESS || size == 0) {
+        return;
+    }
+    std::string binary(size, '\0');
+    char *ptr = &binary[0];
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(ptr),
+            &ptr, NULL) != CL_SUCCESS) {
+        return;
+    }
+
+    // write then rename, so concurrent runs never see half a file
+    const std::string tmp = fname + ".tmp" + std::to_string(getpid());
+    uint64_t keyLen = key.size();
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        out.write((const char*) &keyLen, sizeof(keyLen));
+        out.write(key.data(), key.size());
+        out.write(binary.data(), binary.size());
+        if (!out) {
+            std::cerr << "Warning: couldn't write " << tmp << "\n";
+            remove(tmp.c_str());
+            return;
+        }
+    }
+    if (rename(tmp.c_str(), fname.c_str()) != 0) {
+        remove(tmp.c_str());
+    }
+}
+
+cl::Program ClDevice::program(const std::string &options) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = programs.find(options);
+    if (it != programs.end()) {
+        return it->second;
+    }
+
+    auto t0 = time_now();
+    const std::string source = slurpFile("simulate.cl"),
+                      key = cacheKey(device, withIncludes(source), options),
+                      dir = cacheDir();
+    std::string fname;
+    if (!dir.empty()) {
+        std::ostringstream name;
+        name << dir << "/" << std::hex << std::setfill('0') << std::setw(16)
+            << hashKey(key) << ".bin";
+        fname = name.str();
+    }
+
+    cl::Program prog;
+    if (!fname.empty() && loadBinary(*this, prog, fname, key, options)) {
+        std::cout << "OpenCL program: loaded from cache in " << std::fixed
+            << std::setprecision(2) << time_since(t0) << " sec\n";
+        return programs[options] = prog;
+    }
+
+    // compile simulation program
+    prog = cl::Program(context, source);
+    try {
+        prog.build(options.c_str());
+    } catch (cl::Error err) {
+        std::cerr << "\nOpenCL compilation log:\n" <<
+            prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+        throw err;
+    }
+    if (!fname.empty()) {
+        saveBinary(prog, fname, key);
+    }
+    std::cout << "OpenCL program: built in " << std::fixed
+        << std::setprecision(2) << time_since(t0) << " sec\n";
+    return programs[options] = prog;
+}
+
+static ClDevicePtr openFor(const cl::Device &device) {
+    ClDevicePtr dev(new ClDevice());
+    dev->device = device;
+    dev->context = cl::Context(device);
+    dev->jobs = 1;
+    dev->tuner.reset(new Tuner(device));
+    return dev;
+}
+
+ClDevicePtr openDevice() {
+    cl::Platform platform = cl::Platform::getDefault();
+    cl::Device device = cl::Device::getDefault();
+    std::cout << "OpenCL platform: " << platform.getInfo<CL_PLATFORM_NAME>() << "\n";
+    std::cout << "OpenCL device: " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+    return openFor(device);
+}
+
+std::vector<ClDevicePtr> openDevices(unsigned split) {
+    std::vector<ClDevicePtr> devs;
+    try {
+        cl::Platform platform = cl::Platform::getDefault();
+        std::cout << "OpenCL platform: " << platform.getInfo<CL_PLATFORM_NAME>() << "\n";
+        std::vector<cl::Device> devices;
+        platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+
+        for (auto &device : devices) {
+            std::vector<cl::Device> subs;
+            cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+            if (split > 1 && device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU
+             && device.getInfo<CL_DEVICE_PARTITION_MAX_SUB_DEVICES>() > 1
+             && units >= split) {
+                const cl_device_partition_property props[] = {
+                    CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property) (units / split), 0};
+                try {
+                    device.createSubDevices(props, &subs);
+                } catch (cl::Error err) {
+                    std::cerr << "Warning: couldn't split "
+                        << device.getInfo<CL_DEVICE_NAME>() << ": "
+                        << getCLError(err.err()) << "\n";
+                    subs.clear();
+                }
+            }
+            if (subs.empty()) {
+                subs.push_back(device);
+            }
+
+            std::cout << "OpenCL device: " << device.getInfo<CL_DEVICE_NAME>();
+            if (subs.size() > 1) {
+                std::cout << " (" << subs.size() << " sub-devices)";
+            }
+            std::cout << "\n";
+            for (auto &sub : subs) {
+                devs.push_back(openFor(sub));
+                devs.back()->jobs = subs.size() > 1 ? 1 : split;
+            }
+        }
+    } catch (cl::Error err) {
+        std::cerr << "OpenCL error: "  << err.what() << ": " << getCLError(err.err()) << "\n";
+        exit(1);
+    }
+    return devs;
+}
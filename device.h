@@ -0,0 +1,55 @@
+/* -*- C++ -*- */
+
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include "tuner.h"
+
+// an OpenCL device with its own context and the builds of simulate.cl made
+// for it, shared by every Simulation that runs there; each Simulation makes
+// its own queues and kernel objects
+struct ClDevice {
+    cl::Device device;
+    cl::Context context;
+    unsigned jobs;              // batch jobs to run here at once
+    std::unique_ptr<Tuner> tuner;
+
+    // simulate.cl built with these options: built (or loaded from the binary
+    // cache) on first use, then shared
+    cl::Program program(const std::string &options);
+
+private:
+    std::mutex mtx;
+    std::map<std::string, cl::Program> programs;
+};
+
+typedef std::shared_ptr<ClDevice> ClDevicePtr;
+
+// the default device
+ClDevicePtr openDevice();
+
+// $XDG_CACHE_HOME/explode or ~/.cache/explode; empty if there's neither
+std::string cacheDir();
+
+// names and versions of a device, its driver and its platform
+std::string deviceIdentity(const cl::Device &device);
+
+// 64-bit FNV-1a, for naming cache files; the full key goes inside them to
+// be compared
+uint64_t hashKey(const std::string &key);
+
+// every device of the default platform; CPU devices that can be partitioned
+// are split into up to split sub-devices, so concurrent jobs get separate
+// cores
+std::vector<ClDevicePtr> openDevices(unsigned split);
+
+#endif // __DEVICE_H__
@@ -2,52 +2,130 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <unistd.h>
 
+#include "backend.h"
+#include "batch.h"
+#include "run.h"
 #include "scene.h"
-#include "simulation.h"
 
-void saveImage(HostImage &img, int idx) {
-    std::stringstream fname;
-    fname << "output/frame-" << std::setfill('0') << std::setw(4) << idx << ".png";
-    img.write(fname.str());
-}
-
-void printStatus(int i, int n, float t) {
-    const auto spaces = std::string(80, ' ');
-    static bool first = true;
-    if (first) {
-        std::cout << std::endl << std::setprecision(2) << std::fixed;
-        first = false;
-    }
-
-    std::cout << "\r" << spaces << "\r"
-        << "Simulating: frame " << i+1 << "/" << n << ", t=" << t << "   ";
-    std::cout.flush();
+void usage(char *prog) {
+    std::cerr << "Usage: " << prog << " [options] <scene>\n"
+        << "       " << prog << " -b [options] <scene>...\n"
+        << "  -j <n>    PNG/volume encoder threads (default: all cores)\n"
+        << "  -q <n>    max frames buffered for output (default: threads+2)\n"
+        << "  -p        print per-kernel profiling info\n"
+        << "  -t <file> write a chrome://tracing timeline (implies -p)\n"
+        << "  -c <n>    write output/checkpoint-NNNN.bin every n frames\n"
+        << "  -r <file> resume from a checkpoint\n"
+        << "  -R <dir>  re-render <dir>/volume-NNNN.vol instead of simulating\n"
+        << "  -b        batch: run every scene, several at once, into output/job-NNN\n"
+        << "  -s <B.k=v,v...>  batch sweep over a scene value, e.g. Explosion.size=0.02,0.04\n"
+        << "  -J <n>    batch jobs at once per device (default: 2)\n"
+        << "  -P <n>    interactive preview at 1/n resolution and samples\n"
+        << "  -o <out>  frames as png (default), y4m, rgbz, pipe:<cmd> (Y4M on its\n"
+        << "            stdin) or rawpipe:<cmd> (RGBA); %d, %w, %h and %v in cmd\n"
+        << "            become the output dir, width, height and view number\n";
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <scene>\n";
+    RunOptions opts;
+    bool profiling = false, batch = false;
+    std::string traceFile;
+    std::vector<std::string> sweeps;
+    unsigned perDevice = 2;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:q:pt:c:r:R:bs:J:P:o:")) != -1) {
+        switch (opt) {
+        case 'j':
+            opts.encThreads = atoi(optarg);
+            break;
+        case 'q':
+            opts.queueDepth = atoi(optarg);
+            break;
+        case 'p':
+            profiling = true;
+            break;
+        case 't':
+            profiling = true;
+            traceFile = optarg;
+            break;
+        case 'c':
+            opts.checkpointEvery = atoi(optarg);
+            break;
+        case 'r':
+            opts.restoreFile = optarg;
+            break;
+        case 'R':
+            opts.replayDir = optarg;
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 's':
+            batch = true;
+            sweeps.push_back(optarg);
+            break;
+        case 'J':
+            perDevice = std::max(1, atoi(optarg));
+            break;
+        case 'P':
+            opts.previewScale = std::max(1, atoi(optarg));
+            break;
+        case 'o':
+            opts.sink = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
 
-    Scene scene(argv[1]);
-    Simulation sim(&scene, false);
-    HostImage img(scene.cam.size.x, scene.cam.size.y);
-
-    int nsteps = scene.params.nsteps;
-    auto t0 = time_now();
-    for (int i = 0; i < nsteps; i++) {
-        sim.render(img);
-        saveImage(img, i);
+    if (batch) {
+        if (!opts.restoreFile.empty() || !opts.replayDir.empty() || profiling
+         || opts.previewScale) {
+            std::cerr << "Error: -r, -R, -p, -t and -P don't apply to batches\n";
+            return 1;
+        }
+        std::vector<std::string> scenes(argv + optind, argv + argc);
+        runBatch(expandJobs(scenes, sweeps), perDevice, opts);
+        return 0;
+    }
 
-        sim.advance();
+    Scene scene(argv[optind]);
+    if (!opts.replayDir.empty()) {
+        // nothing gets simulated, and the volumes being read stay as they are
+        scene.params.exports = 0;
+        opts.checkpointEvery = 0;
+    }
+    std::unique_ptr<Profiler> prof(profiling ? new Profiler() : NULL);
+    std::unique_ptr<Backend> sim(makeBackend(&scene, prof.get()));
 
-        printStatus(i, nsteps, sim.getT());
+    if (opts.previewScale) {
+        if (!opts.restoreFile.empty()) {
+            sim->loadCheckpoint(opts.restoreFile);
+        }
+        runPreview(scene, *sim, opts);
+        return 0;
     }
+
+    auto t0 = time_now();
+    int frames = runFrames(scene, *sim, prof.get(), opts);
     double t = time_since(t0);
-    std::cout << "\nFinished in " << t << " sec (" << (nsteps / t) << " fps)\n";
+    std::cout << "\nFinished in " << t << " sec (" << (frames / t) << " fps)\n";
 
-    sim.dumpProfiling();
+    if (prof) {
+        prof->summary();
+        sim->dumpProfiling();
+        if (!traceFile.empty()) {
+            prof->writeTrace(traceFile);
+        }
+    }
 }
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "objects.h"
+
+// triangles cover voxels this close, so a closed mesh leaves no gaps
+static const float SHELL = 0.87f;      // sqrt(3)/2
+
+static cl_float3 sub(const cl_float3 &a, const cl_float3 &b) {
+    return {a.s[0] - b.s[0], a.s[1] - b.s[1], a.s[2] - b.s[2]};
+}
+
+static float dot(const cl_float3 &a, const cl_float3 &b) {
+    return a.s[0] * b.s[0] + a.s[1] * b.s[1] + a.s[2] * b.s[2];
+}
+
+// squared distance from p to triangle abc (Ericson, Real-Time Collision
+// Detection 5.1.5), kept in step with triangle_dist2 in simulate.cl
+static float triangleDist2(const cl_float3 &p, const cl_float3 &a,
+    const cl_float3 &b, const cl_float3 &c)
+{
+    cl_float3 ab = sub(b, a), ac = sub(c, a), ap = sub(p, a);
+    float d1 = dot(ab, ap), d2 = dot(ac, ap);
+    float u = 0.0f, v = 0.0f;
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        // a
+    } else {
+        cl_float3 bp = sub(p, b), cp = sub(p, c);
+        float d3 = dot(ab, bp), d4 = dot(ac, bp),
+              d5 = dot(ab, cp), d6 = dot(ac, cp);
+        float vc = d1 * d4 - d3 * d2,
+              vb = d5 * d2 - d1 * d6,
+              va = d3 * d6 - d5 * d4;
+        if (d3 >= 0.0f && d4 <= d3) {
+            u = 1.0f;                                   // b
+        } else if (d6 >= 0.0f && d5 <= d6) {
+            v = 1.0f;                                   // c
+        } else if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+            u = d1 / (d1 - d3);                         // ab
+        } else if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+            v = d2 / (d2 - d6);                         // ac
+        } else if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+            v = (d4 - d3) / ((d4 - d3) + (d5 - d6));    // bc
+            u = 1.0f - v;
+        } else {
+            float denom = 1.0f / (va + vb + vc);        // inside
+            u = vb * denom;
+            v = vc * denom;
+        }
+    }
+    cl_float3 q = {a.s[0] + u * ab.s[0] + v * ac.s[0],
+                   a.s[1] + u * ab.s[1] + v * ac.s[1],
+                   a.s[2] + u * ab.s[2] + v * ac.s[2]};
+    cl_float3 d = sub(p, q);
+    return dot(d, d);
+}
+
+bool objectContains(const Object &obj, float x, float y, float z) {
+    cl_float3 p = {x, y, z};
+    switch (obj.shape) {
+    case SHAPE_BOX:
+        return x >= obj.v0.s[0] && x <= obj.v1.s[0]
+            && y >= obj.v0.s[1] && y <= obj.v1.s[1]
+            && z >= obj.v0.s[2] && z <= obj.v1.s[2];
+    case SHAPE_SPHERE: {
+        cl_float3 d = sub(p, obj.v0);
+        return dot(d, d) <= obj.v1.s[0] * obj.v1.s[0];
+    }
+    case SHAPE_TRIANGLE:
+        return triangleDist2(p, obj.v0, obj.v1, obj.v2) <= SHELL * SHELL;
+    }
+    return false;
+}
+
+// world-space bounds of what obj can mark
+static void objectBounds(const Object &obj, float lo[3], float hi[3]) {
+    for (int i = 0; i < 3; i++) {
+        switch (obj.shape) {
+        case SHAPE_BOX:
+            lo[i] = obj.v0.s[i];
+            hi[i] = obj.v1.s[i];
+            break;
+        case SHAPE_SPHERE:
+            lo[i] = obj.v0.s[i] - obj.v1.s[0];
+            hi[i] = obj.v0.s[i] + obj.v1.s[0];
+            break;
+        default:
+            lo[i] = std::min(obj.v0.s[i], std::min(obj.v1.s[i], obj.v2.s[i]))
+                - SHELL;
+            hi[i] = std::max(obj.v0.s[i], std::max(obj.v1.s[i], obj.v2.s[i]))
+                + SHELL;
+        }
+    }
+}
+
+ObjectBins binObjects(const std::vector<Object> &objects,
+    int NX, int NY, int NZ, int z0)
+{
+    ObjectBins bins;
+    bins.nx = (NX + OBJ_BIN - 1) / OBJ_BIN;
+    bins.ny = (NY + OBJ_BIN - 1) / OBJ_BIN;
+    bins.nz = (NZ + OBJ_BIN - 1) / OBJ_BIN;
+    const int nbins = bins.nx * bins.ny * bins.nz,
+              nb[3] = {bins.nx, bins.ny, bins.nz};
+
+    // bin ranges of each object, or none if it misses the grid; counted
+    // first, then filled
+    struct Range { int lo[3], hi[3]; };
+    std::vector<Range> ranges;
+    std::vector<cl_uint> count(nbins + 1, 0);
+    const float shift[3] = {0.0f, 0.0f, (float) z0};
+    for (size_t o = 0; o + 1 < objects.size(); o++) {
+        float lo[3], hi[3];
+        objectBounds(objects[o], lo, hi);
+        Range r;
+        bool hit = true;
+        for (int i = 0; i < 3; i++) {
+            r.lo[i] = std::max(0, (int) std::floor(lo[i] - shift[i]) / OBJ_BIN);
+            r.hi[i] = std::min(nb[i] - 1,
+                (int) std::floor(hi[i] - shift[i]) / OBJ_BIN);
+            hit = hit && hi[i] - shift[i] >= 0.0f && r.lo[i] <= r.hi[i];
+        }
+        if (!hit) {
+            r.lo[0] = 1;
+            r.hi[0] = 0;
+        }
+        ranges.push_back(r);
+
+        for (int k = r.lo[2]; k <= r.hi[2]; k++)
+        for (int j = r.lo[1]; j <= r.hi[1]; j++)
+        for (int i = r.lo[0]; i <= r.hi[0]; i++) {
+            count[(k * bins.ny + j) * bins.nx + i]++;
+        }
+    }
+
+    bins.index.resize(nbins + 1);
+    cl_uint at = nbins + 1;
+    for (int b = 0; b <= nbins; b++) {
+        bins.index[b] = at;
+        at += count[b];
+    }
+    bins.index.resize(at);
+    std::vector<cl_uint> next(bins.index.begin(), bins.index.begin() + nbins);
+    for (size_t o = 0; o < ranges.size(); o++) {
+        const Range &r = ranges[o];
+        for (int k = r.lo[2]; k <= r.hi[2]; k++)
+        for (int j = r.lo[1]; j <= r.hi[1]; j++)
+        for (int i = r.lo[0]; i <= r.hi[0]; i++) {
+            bins.index[next[(k * bins.ny + j) * bins.nx + i]++] = o;
+        }
+    }
+    return bins;
+}
+
+std::vector<Object> loadMesh(const std::string &fname) {
+    std::ifstream in(fname);
+    if (!in.is_open()) {
+        std::cerr << "Error: couldn't open mesh '" << fname << "'\n";
+        exit(1);
+    }
+
+    std::vector<cl_float3> verts;
+    std::vector<Object> tris;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream words(line);
+        std::string tok;
+        words >> tok;
+        if (tok == "v") {
+            cl_float3 v = {0, 0, 0};
+            words >> v.s[0] >> v.s[1] >> v.s[2];
+            verts.push_back(v);
+        } else if (tok == "f") {
+            // "f 1 2 3", "f 1/1/1 2/2/2 3/3/3", negative = from the end
+            std::vector<int> face;
+            while (words >> tok) {
+                int n = atoi(tok.c_str());
+                n = n < 0 ? verts.size() + n : n - 1;
+                if (n < 0 || n >= (int) verts.size()) {
+                    std::cerr << "Error: bad vertex '" << tok << "' in mesh '"
+                        << fname << "'\n";
+                    exit(1);
+                }
+                face.push_back(n);
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                Object tri = Object();
+                tri.shape = SHAPE_TRIANGLE;
+                tri.v0 = verts[face[0]];
+                tri.v1 = verts[face[i-1]];
+                tri.v2 = verts[face[i]];
+                tris.push_back(tri);
+            }
+        }
+    }
+    return tris;
+}
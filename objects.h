@@ -0,0 +1,35 @@
+/* -*- C++ -*- */
+
+#ifndef __OBJECTS_H__
+#define __OBJECTS_H__
+
+#include <string>
+#include <vector>
+
+#include "scene.h"
+
+// side of a bin in voxels (OBJ_BIN in simulate.cl)
+const int OBJ_BIN = 8;
+
+// the objects touching each OBJ_BIN^3 block of a grid, so voxelizing only
+// tests those near each voxel. index holds nbins+1 offsets into itself,
+// bins x fastest, then the object numbers of each bin.
+struct ObjectBins {
+    int nx, ny, nz;
+    std::vector<cl_uint> index;
+};
+
+// bins over an NX x NY x NZ grid whose layer 0 is layer z0 of the scene's
+// grid (for z-slabs); objects are numbered as in objects, whose last
+// ("null") one is skipped
+ObjectBins binObjects(const std::vector<Object> &objects,
+    int NX, int NY, int NZ, int z0=0);
+
+// whether voxel p (in scene grid coordinates) is inside obj; for
+// triangles, within half a voxel diagonal of it
+bool objectContains(const Object &obj, float x, float y, float z);
+
+// the triangles of a Wavefront .obj file, polygons split into fans
+std::vector<Object> loadMesh(const std::string &fname);
+
+#endif // __OBJECTS_H__
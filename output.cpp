@@ -0,0 +1,379 @@
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <zlib.h>
+
+#include "output.h"
+
+class PngSink : public FrameSink {
+public:
+    PngSink(const std::string &dir, size_t nviews) :
+        dir(dir), nviews(nviews) {}
+
+    void write(const HostImage &img, int view, int idx) {
+        std::stringstream fname;
+        fname << dir << "/frame-";
+        if (nviews > 1) {
+            fname << "v" << view << "-";
+        }
+        fname << std::setfill('0') << std::setw(4) << idx << ".png";
+        img.write(fname.str());
+    }
+
+    const char *name() const { return "png"; }
+
+private:
+    std::string dir;
+    size_t nviews;
+};
+
+// One sequential stream per view, to a file or an encoder's stdin. Frames
+// are converted on the calling encoder thread, then written in the order
+// they were expected, as soon as the ones before them are in.
+class StreamSink : public FrameSink {
+public:
+    enum Format {Y4M, RGBA, RGBZ};
+
+    StreamSink(Format format, const std::string &dir,
+        const std::vector<cl_uint2> &sizes, const std::string &target,
+        bool pipe) :
+        format(format), isPipe(pipe), views(sizes.size())
+    {
+        // a dead encoder should be a write error, not a kill
+        if (pipe) {
+            signal(SIGPIPE, SIG_IGN);
+        }
+        for (size_t v = 0; v < views.size(); v++) {
+            View &view = views[v];
+            const unsigned w = sizes[v].s[0], h = sizes[v].s[1];
+            view.name = expand(target, dir, w, h, v);
+            view.out = pipe ? popen(view.name.c_str(), "w")
+                : fopen(view.name.c_str(), "wb");
+            if (!view.out) {
+                std::cerr << "Error: couldn't " << (pipe ? "run '" : "open '")
+                    << view.name << "'\n";
+                exit(1);
+            }
+            put(view, header(w, h));
+        }
+    }
+
+    ~StreamSink() {
+        finish();
+    }
+
+    void expect(int idx) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &view : views) {
+            view.order.push_back(idx);
+        }
+    }
+
+    void write(const HostImage &img, int v, int idx) {
+        std::string data = convert(img, idx);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        View &view = views[v];
+        view.pending[idx].swap(data);
+        while (!view.order.empty()) {
+            auto it = view.pending.find(view.order.front());
+            if (it == view.pending.end()) {
+                break;
+            }
+            put(view, it->second);
+            view.pending.erase(it);
+            view.order.pop_front();
+        }
+    }
+
+    void finish() {
+        for (auto &view : views) {
+            if (!view.out) {
+                continue;
+            }
+            int status = isPipe ? pclose(view.out) : fclose(view.out);
+            if (status != 0) {
+                std::cerr << "Warning: '" << view.name << "' "
+                    << (isPipe ? "exited with status " : "failed to close, ")
+                    << status << "\n";
+            }
+            view.out = NULL;
+        }
+    }
+
+    const char *name() const {
+        return format == Y4M ? "y4m" : format == RGBA ? "rgba" : "rgbz";
+    }
+
+private:
+    struct View {
+        std::string name;       // file or command
+        FILE *out;
+        std::deque<int> order;  // frames expected and not yet written
+        std::map<int, std::string> pending;
+    };
+
+    static std::string expand(const std::string &s, const std::string &dir,
+        unsigned w, unsigned h, size_t v)
+    {
+        std::ostringstream out;
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] == '%' && i + 1 < s.size() && strchr("dwhv", s[i+1])) {
+                switch (s[++i]) {
+                case 'd': out << dir; break;
+                case 'w': out << w; break;
+                case 'h': out << h; break;
+                case 'v': out << v; break;
+                }
+            } else {
+                out << s[i];
+            }
+        }
+        return out.str();
+    }
+
+    std::string header(unsigned w, unsigned h) {
+        if (format == Y4M) {
+            // 25 fps, as mkvideo.sh
+            std::ostringstream head;
+            head << "YUV4MPEG2 W" << w << " H" << h
+                << " F25:1 Ip A1:1 C444\n";
+            return head.str();
+        } else if (format == RGBZ) {
+            FrameStreamHeader head = {};
+            memcpy(head.magic, "EXPLFRM", 8);
+            head.version = 1;
+            head.w = w;
+            head.h = h;
+            return std::string((const char *) &head, sizeof(head));
+        }
+        return "";
+    }
+
+    std::string convert(const HostImage &img, int idx) {
+        const size_t npix = (size_t) img.w * img.h;
+        const unsigned char *px = (const unsigned char *) img.data;
+        if (format == Y4M) {
+            // BT.601 studio range, full-resolution chroma
+            std::string out = "FRAME\n";
+            size_t off = out.size();
+            out.resize(off + 3 * npix);
+            unsigned char *Y = (unsigned char *) &out[off],
+                          *U = Y + npix,
+                          *V = U + npix;
+            for (size_t i = 0; i < npix; i++) {
+                int r = px[4*i], g = px[4*i+1], b = px[4*i+2];
+                Y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+                U[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                V[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+            }
+            return out;
+        } else if (format == RGBZ) {
+            uLong srcLen = 4 * npix;
+            uLongf len = compressBound(srcLen);
+            int32_t frame = idx;
+            uint64_t size = 0;
+            std::string out(sizeof(frame) + sizeof(size) + len, '\0');
+            Bytef *dst = (Bytef *) &out[sizeof(frame) + sizeof(size)];
+            if (compress2(dst, &len, px, srcLen, 1) != Z_OK) {
+                std::cerr << "Error: compressing frame " << idx << " failed\n";
+                exit(1);
+            }
+            size = len;
+            memcpy(&out[0], &frame, sizeof(frame));
+            memcpy(&out[sizeof(frame)], &size, sizeof(size));
+            out.resize(sizeof(frame) + sizeof(size) + len);
+            return out;
+        }
+        return std::string(img.data, 4 * npix);
+    }
+
+    void put(View &view, const std::string &data) {
+        if (view.out && fwrite(data.data(), 1, data.size(), view.out)
+                != data.size()) {
+            std::cerr << "Error: writing to '" << view.name << "' failed\n";
+            exit(1);
+        }
+    }
+
+    const Format format;
+    const bool isPipe;
+    std::vector<View> views;
+    std::mutex mtx;
+};
+
+FrameSink *makeFrameSink(const std::string &spec, const std::string &dir,
+    const std::vector<cl_uint2> &sizes)
+{
+    // dir/<base>.<ext>, or dir/<base>-vK.<ext> per view
+    auto files = [&](const std::string &base, const std::string &ext) {
+        return "%d/" + base + (sizes.size() > 1 ? "-v%v." : ".") + ext;
+    };
+    if (spec == "png") {
+        return new PngSink(dir, sizes.size());
+    } else if (spec == "y4m") {
+        return new StreamSink(StreamSink::Y4M, dir, sizes, files("video", "y4m"),
+            false);
+    } else if (spec == "rgbz") {
+        return new StreamSink(StreamSink::RGBZ, dir, sizes, files("frames", "rgbz"),
+            false);
+    } else if (spec.compare(0, 5, "pipe:") == 0) {
+        return new StreamSink(StreamSink::Y4M, dir, sizes, spec.substr(5), true);
+    } else if (spec.compare(0, 8, "rawpipe:") == 0) {
+        return new StreamSink(StreamSink::RGBA, dir, sizes, spec.substr(8), true);
+    }
+    std::cerr << "Error: unknown frame output '" << spec << "'\n";
+    exit(1);
+}
+
+FrameWriter::FrameWriter(const std::string &dir,
+    const std::vector<cl_uint2> &sizes, unsigned nthreads, unsigned depth,
+    Profiler *prof, const std::string &sinkSpec) :
+    pool(nthreads), prof(prof), sink(makeFrameSink(sinkSpec, dir, sizes))
+{
+    if (depth == 0) {
+        depth = pool.size() + 2;
+    }
+    frames.resize(depth);
+    for (auto &frame : frames) {
+        for (auto &size : sizes) {
+            images.emplace_back(new HostImage(size.s[0], size.s[1]));
+            frame.push_back(images.back().get());
+        }
+        freeFrames.push_back(&frame);
+    }
+}
+
+FrameWriter::~FrameWriter() {
+    finish();
+}
+
+FrameWriter::Frame &FrameWriter::acquire() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this] { return !freeFrames.empty(); });
+    Frame *frame = freeFrames.back();
+    freeFrames.pop_back();
+    return *frame;
+}
+
+void FrameWriter::submit(Frame &frame, int idx) {
+    Frame *p = &frame;
+    sink->expect(idx);
+    pool.run([this, p, idx] {
+        for (size_t v = 0; v < p->size(); v++) {
+            HostImage *img = (*p)[v];
+
+            // readback may still be in flight
+            img->sync();
+
+            auto t0 = time_now();
+            sink->write(*img, v, idx);
+            if (prof) {
+                prof->hostSpan(sink->name(), t0, time_now(), idx);
+            }
+        }
+
+        release(p);
+    });
+}
+
+void FrameWriter::finish() {
+    pool.wait();
+    sink->finish();
+}
+
+void FrameWriter::release(Frame *frame) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        freeFrames.push_back(frame);
+    }
+    cv.notify_one();
+}
+
+VolumeWriter::VolumeWriter(const std::string &dir, unsigned nthreads,
+    unsigned depth, Profiler *prof) :
+    pool(nthreads), prof(prof), dir(dir)
+{
+    if (depth == 0) {
+        depth = pool.size() + 2;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        frames.emplace_back(new VolumeFrame());
+        freeFrames.push_back(frames.back().get());
+    }
+}
+
+VolumeWriter::~VolumeWriter() {
+    finish();
+}
+
+VolumeFrame &VolumeWriter::acquire() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this] { return !freeFrames.empty(); });
+    VolumeFrame *vol = freeFrames.back();
+    freeFrames.pop_back();
+    return *vol;
+}
+
+void VolumeWriter::submit(VolumeFrame &vol, int idx) {
+    VolumeFrame *p = &vol;
+    pool.run([this, p, idx] {
+        p->sync();
+
+        auto t0 = time_now();
+        std::stringstream fname;
+        fname << dir << "/volume-" << std::setfill('0') << std::setw(4) << idx << ".vol";
+        p->write(fname.str());
+        if (prof) {
+            prof->hostSpan("volume", t0, time_now(), idx);
+        }
+
+        release(p);
+    });
+}
+
+void VolumeWriter::finish() {
+    pool.wait();
+}
+
+void VolumeWriter::release(VolumeFrame *vol) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        freeFrames.push_back(vol);
+    }
+    cv.notify_one();
+}
+
+VolumeReader::VolumeReader(const std::string &dir, int first, int end,
+    Profiler *prof) :
+    pool(1), prof(prof), dir(dir), idx(first), end(end), ahead(0)
+{
+    prefetch();
+}
+
+VolumeFrame &VolumeReader::next() {
+    pool.wait();
+    int ready = ahead;
+    ahead ^= 1;
+    idx++;
+    prefetch();
+    return frames[ready];
+}
+
+void VolumeReader::prefetch() {
+    if (idx >= end) {
+        return;
+    }
+    VolumeFrame *p = &frames[ahead];
+    int i = idx;
+    pool.run([this, p, i] {
+        auto t0 = time_now();
+        std::stringstream fname;
+        fname << dir << "/volume-" << std::setfill('0') << std::setw(4) << i << ".vol";
+        p->read(fname.str());
+        if (prof) {
+            prof->hostSpan("volumeRead", t0, time_now(), i);
+        }
+    });
+}
@@ -0,0 +1,137 @@
+/* -*- C++ -*- */
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "profiler.h"
+#include "threadpool.h"
+#include "util.h"
+
+// Where FrameWriter puts rendered frames. write() runs on the encoder
+// threads, several at once and not necessarily in frame order; expect()
+// runs on the submitting thread, in order, before each frame's writes.
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+
+    virtual void expect(int idx) {}
+    virtual void write(const HostImage &img, int view, int idx) = 0;
+
+    // after the last write
+    virtual void finish() {}
+
+    // for the profiler
+    virtual const char *name() const = 0;
+};
+
+// A sink for spec, one of:
+//   png            dir/frame-NNNN.png, or dir/frame-vK-NNNN.png per view K
+//                  when there are several
+//   y4m            dir/video.y4m (or video-vK.y4m), 4:4:4 YUV4MPEG2
+//   rgbz           dir/frames.rgbz (or frames-vK.rgbz), see
+//                  FrameStreamHeader
+//   pipe:<cmd>     YUV4MPEG2 into the stdin of cmd, one process per view
+//   rawpipe:<cmd>  raw RGBA into the stdin of cmd
+// In a command, %d, %w, %h and %v become dir and the view's width, height
+// and number, e.g.
+//   pipe:ffmpeg -y -loglevel error -i - %d/explosion-%v.mp4
+FrameSink *makeFrameSink(const std::string &spec, const std::string &dir,
+    const std::vector<cl_uint2> &sizes);
+
+// On-disk layout of an rgbz frame stream, the lossless built-in container:
+// this header, then per frame its number (int32), its compressed size
+// (uint64) and a zlib stream of w*h RGBA pixels, top row first.
+struct FrameStreamHeader {
+    char magic[8];              // "EXPLFRM" and a NUL
+    uint32_t version;
+    uint32_t w, h;
+};
+
+// Writes rendered frames to a FrameSink on a pool of encoder threads.
+// A frame is one HostImage per view, from a fixed set; acquire() blocks until
+// one is free, which bounds memory and throttles the simulation when
+// encoding falls behind.
+class FrameWriter {
+public:
+    typedef std::vector<HostImage *> Frame;
+
+    // sizes holds the (width, height) of each view; sink is a
+    // makeFrameSink() spec
+    FrameWriter(const std::string &dir, const std::vector<cl_uint2> &sizes,
+        unsigned nthreads=0, unsigned depth=0, Profiler *prof=NULL,
+        const std::string &sink="png");
+    ~FrameWriter();
+
+    Frame &acquire();
+    void submit(Frame &frame, int idx);
+
+    // wait for all submitted frames to be written
+    void finish();
+
+private:
+    void release(Frame *frame);
+
+    ThreadPool pool;
+    Profiler *prof;
+    std::unique_ptr<FrameSink> sink;
+    std::vector<std::unique_ptr<HostImage>> images;
+    std::vector<Frame> frames;
+    std::vector<Frame *> freeFrames;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// Writes exported volumes to dir/volume-NNNN.vol the same way, from a
+// fixed set of VolumeFrames; depth bounds the readbacks in flight.
+class VolumeWriter {
+public:
+    VolumeWriter(const std::string &dir, unsigned nthreads=0, unsigned depth=0,
+        Profiler *prof=NULL);
+    ~VolumeWriter();
+
+    VolumeFrame &acquire();
+    void submit(VolumeFrame &vol, int idx);
+    void finish();
+
+private:
+    void release(VolumeFrame *vol);
+
+    ThreadPool pool;
+    Profiler *prof;
+    std::string dir;
+    std::vector<std::unique_ptr<VolumeFrame>> frames;
+    std::vector<VolumeFrame *> freeFrames;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// Reads dir/volume-NNNN.vol for frames [first, end) in order, keeping the
+// next frame loading on a background thread while the current one is used.
+class VolumeReader {
+public:
+    VolumeReader(const std::string &dir, int first, int end,
+        Profiler *prof=NULL);
+
+    // the next frame; valid until the following call
+    VolumeFrame &next();
+
+private:
+    void prefetch();
+
+    ThreadPool pool;
+    Profiler *prof;
+    std::string dir;
+    int idx, end;               // frame being prefetched, end of range
+    VolumeFrame frames[2];
+    int ahead;                  // slot idx is read into
+};
+
+#endif // __OUTPUT_H__
@@ -0,0 +1,157 @@
+#include <fstream>
+#include <iostream>
+
+#include "profiler.h"
+
+Profiler::Profiler() :
+    epoch(time_now()), devOffset(0), calibrated(false), frame(-1)
+{
+}
+
+void Profiler::calibrate(const cl::CommandQueue &queue) {
+    // a marker completes as soon as it reaches the device; its end time is
+    // (very nearly) now
+    try {
+        cl::Event ev;
+        queue.enqueueMarkerWithWaitList(NULL, &ev);
+        ev.wait();
+        double now = hostUs(time_now());
+        cl_ulong end = ev.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+        std::lock_guard<std::mutex> lock(mtx);
+        devOffset = (cl_long) end - (cl_long) (now * 1e3);
+        calibrated = true;
+    } catch (cl::Error err) {
+        // fall back to aligning on the first resolved event
+    }
+}
+
+void Profiler::setFrame(int f) {
+    std::lock_guard<std::mutex> lock(mtx);
+    frame = f;
+}
+
+void Profiler::record(const std::string &name, const cl::Event &ev, int lane) {
+    std::lock_guard<std::mutex> lock(mtx);
+    pending.push_back({name, ev, lane, frame});
+}
+
+void Profiler::hostSpan(const std::string &name, TimePoint t0, TimePoint t1,
+    int fr)
+{
+    double start = hostUs(t0), end = hostUs(t1);
+    std::lock_guard<std::mutex> lock(mtx);
+    add({name, start, end - start, threadLane(), fr < 0 ? frame : fr});
+}
+
+void Profiler::resolve(bool wait) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    size_t keep = 0;
+    for (size_t i = 0; i < pending.size(); i++) {
+        Pending &p = pending[i];
+        if (wait) {
+            p.ev.wait();
+        } else if (p.ev.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+            pending[keep++] = p;
+            continue;
+        }
+
+        cl_ulong t0 = p.ev.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong t1 = p.ev.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        if (!calibrated) {
+            devOffset = (cl_long) t1 - (cl_long) (hostUs(time_now()) * 1e3);
+            calibrated = true;
+        }
+        add({p.name, ((cl_long) t0 - devOffset) * 1e-3, (t1 - t0) * 1e-3,
+            p.lane, p.frame});
+    }
+    pending.resize(keep);
+}
+
+void Profiler::summary() {
+    resolve(true);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    printProfiling(names.data(), times.data(), calls.data(), names.size());
+}
+
+std::vector<Profiler::Total> Profiler::totals() {
+    resolve(true);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<Total> out;
+    for (size_t i = 0; i < names.size(); i++) {
+        out.push_back({names[i], times[i], calls[i]});
+    }
+    return out;
+}
+
+void Profiler::writeTrace(const std::string &fname) {
+    resolve(true);
+
+    std::ofstream out(fname);
+    if (!out.is_open()) {
+        std::cerr << "Error: couldn't write trace '" << fname << "'\n";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+    // row labels
+    int nlanes = LANE_HOST + lanes.size();
+    for (int l = 0; l < nlanes; l++) {
+        std::string label = l == LANE_SIM ? "device: simulation"
+            : l == LANE_RENDER ? "device: render"
+            : "host thread " + std::to_string(l - LANE_HOST);
+        out << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 0, \"tid\": "
+            << l << ", \"args\": {\"name\": \"" << label << "\"}},\n";
+    }
+
+    out << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < spans.size(); i++) {
+        const Span &s = spans[i];
+        out << "{\"ph\": \"X\", \"name\": \"" << s.name << "\", \"pid\": 0, \"tid\": "
+            << s.lane << ", \"ts\": " << s.start << ", \"dur\": " << s.dur
+            << ", \"args\": {\"frame\": " << s.frame << "}}"
+            << (i + 1 < spans.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+
+    std::cout << "Wrote " << spans.size() << " trace events to " << fname << "\n";
+}
+
+void Profiler::add(const Span &s) {
+    spans.push_back(s);
+
+    auto it = index.find(s.name);
+    int i;
+    if (it == index.end()) {
+        i = names.size();
+        index[s.name] = i;
+        names.push_back(s.name);
+        times.push_back(0.0);
+        calls.push_back(0);
+    } else {
+        i = it->second;
+    }
+    times[i] += s.dur * 1e-6;
+    calls[i]++;
+}
+
+double Profiler::hostUs(TimePoint t) {
+    std::chrono::duration<double, std::micro> dur = t - epoch;
+    return dur.count();
+}
+
+int Profiler::threadLane() {
+    auto id = std::this_thread::get_id();
+    auto it = lanes.find(id);
+    if (it != lanes.end()) {
+        return it->second;
+    }
+    int lane = LANE_HOST + lanes.size();
+    lanes[id] = lane;
+    return lane;
+}
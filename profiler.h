@@ -0,0 +1,87 @@
+/* -*- C++ -*- */
+
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include "util.h"
+
+// Collects device command events and host-side spans without stalling the
+// queue: events are kept pending and only read once they have completed.
+// Produces a per-name summary table and a chrome://tracing / Perfetto JSON
+// timeline.
+class Profiler {
+public:
+    // trace rows; host threads get their own rows after LANE_HOST
+    enum { LANE_SIM, LANE_RENDER, LANE_HOST };
+
+    Profiler();
+
+    // line up device timestamps with the host clock
+    void calibrate(const cl::CommandQueue &queue);
+
+    // frame number attached to subsequent records
+    void setFrame(int f);
+
+    void record(const std::string &name, const cl::Event &ev, int lane=LANE_SIM);
+    void hostSpan(const std::string &name, TimePoint t0, TimePoint t1,
+        int frame=-1);
+
+    // harvest completed events; with wait=true, block for all of them
+    void resolve(bool wait=false);
+
+    void summary();
+    void writeTrace(const std::string &fname);
+
+    // per-name totals, in order of first appearance; waits for everything
+    struct Total {
+        std::string name;
+        double secs;
+        unsigned calls;
+    };
+    std::vector<Total> totals();
+
+private:
+    struct Pending {
+        std::string name;
+        cl::Event ev;
+        int lane, frame;
+    };
+
+    struct Span {
+        std::string name;
+        double start, dur;      // microseconds since epoch
+        int lane, frame;
+    };
+
+    void add(const Span &s);
+    double hostUs(TimePoint t);
+    int threadLane();
+
+    std::mutex mtx;
+    TimePoint epoch;
+    cl_long devOffset;          // device ns at host epoch
+    bool calibrated;
+    int frame;
+
+    std::vector<Pending> pending;
+    std::vector<Span> spans;
+
+    // totals, in order of first appearance
+    std::vector<std::string> names;
+    std::vector<double> times;
+    std::vector<unsigned> calls;
+    std::map<std::string, int> index;
+
+    std::map<std::thread::id, int> lanes;
+};
+
+#endif // __PROFILER_H__
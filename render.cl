@@ -11,14 +11,21 @@ struct Light {
 
 #define RHO_EPS     0.001f
 #define TX_EPS      0.01f
+#define MACRO       8           // occupancy macro-cell size (voxels)
+
+// scene builds set these from SimParam samples/lightsamples
+#ifndef NSAMP
+#define NSAMP       256
+#endif
+#ifndef NLSAMP
+#define NLSAMP      96
+#endif
 
 __constant const int
-    nsamp = 256,        // main ray samples
-    nlsamp = 96;        // light ray samples
-    // nsamp = 128,        // main ray samples
-    // nlsamp = 64;        // light ray samples
+    nsamp = NSAMP,      // main ray samples
+    nlsamp = NLSAMP;    // light ray samples
 __constant const float
-    maxDist = 1.7320508f,       // cube diagonal = sqrt(3)
+    maxDist = 1.7320508f,       // unit cube diagonal = sqrt(3), bounds any grid
     ds = maxDist / nsamp,       // main ray step size
     dsl = maxDist / nlsamp,     // light ray step size
     absorption = 30.0f;
@@ -27,90 +34,385 @@ inline float4 getBlackbody(image2d_t Spec, float temp) {
     return read_imagef(Spec, samp_n, (float2)(temp / tMax, 0));
 }
 
+// normalized texture coords of a world position
+inline float4 tex(image3d_t img, float3 world) {
+    return to4f(world / grid_extent(img));
+}
+
+// world size of a macro-cell of T's grid; Occ has whole ones, so it can
+// reach past the grid's far faces
+inline float macro_size(image3d_t T) {
+    return MACRO * grid_voxel(T);
+}
+
+// normalized coords in Occ of a world position, for macro-cells of size cell
+inline float4 occ_tex(image3d_t Occ, float cell, float3 world) {
+    return to4f(world / (cell * convert_float3(image_dims(Occ))));
+}
+
+// Occupancy acceleration structure: one texel per MACRO^3 macro-cell holding
+// the max density of every voxel its samples can interpolate from (or 1 if
+// it contains an object), and the bounding box of the occupied macro-cells
+// as (min xyz, max xyz).
+void __kernel build_occupancy(
+    __read_only image3d_t T,
+    __read_only image3d_t B,
+    __write_only image3d_t Occ,
+    __global int *bbox)
+{
+    int3 cell = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 c0 = cell * MACRO;
+
+    // the border is one voxel wider for linear interpolation
+    float occ = 0.0f;
+    for (int k = -1; k <= MACRO; k++) {
+        for (int j = -1; j <= MACRO; j++) {
+            for (int i = -1; i <= MACRO; i++) {
+                int3 c = c0 + (int3)(i, j, k);
+                occ = fmax(occ, ix(T, c).y);
+            }
+        }
+    }
+    for (int k = 0; k < MACRO; k++) {
+        for (int j = 0; j < MACRO; j++) {
+            for (int i = 0; i < MACRO; i++) {
+                int3 c = c0 + (int3)(i, j, k);
+                if (read_imageui(B, samp_i, to4i(c)).x == 1) {
+                    occ = 1.0f;
+                }
+            }
+        }
+    }
+    write_imagef(Occ, to4i(cell), occ);
+
+    if (occ > RHO_EPS) {
+        atomic_min(&bbox[0], cell.x);
+        atomic_min(&bbox[1], cell.y);
+        atomic_min(&bbox[2], cell.z);
+        atomic_max(&bbox[3], cell.x);
+        atomic_max(&bbox[4], cell.y);
+        atomic_max(&bbox[5], cell.z);
+    }
+}
+
+// range [t0, t1] along a ray (unit dir) inside the occupied bounding box;
+// cell is the macro-cell size in world coords
+inline bool clip_ray(
+    __global const int *bbox,
+    float cell,
+    float3 pos,
+    float3 ray,
+    float *t0,
+    float *t1)
+{
+    if (bbox[0] > bbox[3]) {
+        return false;
+    }
+
+    float3 lo = (float3)(bbox[0], bbox[1], bbox[2]) * cell,
+           hi = (float3)(bbox[3] + 1, bbox[4] + 1, bbox[5] + 1) * cell;
+    float3 inv = 1.0f / ray;
+    float3 ta = (lo - pos) * inv,
+           tb = (hi - pos) * inv;
+    float3 tmin = fmin(ta, tb),
+           tmax = fmax(ta, tb);
+    *t0 = fmax(fmax(tmin.x, tmin.y), fmax(tmin.z, 0.0f));
+    *t1 = fmin(fmin(tmax.x, tmax.y), tmax.z);
+    return *t0 <= *t1;
+}
+
+// distance along a ray (unit dir) to where it leaves pos's macro-cell
+inline float cell_exit(float3 pos, float3 ray, float cell) {
+    float3 p = pos / cell;
+    float3 bound = floor(p) + select((float3)(0.0f), (float3)(1.0f), ray > 0.0f);
+    float3 t = (bound - p) * cell / ray;
+    t = select(t, (float3)(INFINITY), ray == 0.0f);
+    return fmin(fmin(t.x, t.y), t.z);
+}
+
+// number of whole steps of size step that clear an empty macro-cell (of
+// size cell), or 0
+inline int skip_empty(
+    image3d_t Occ,
+    float cell,
+    float3 pos,
+    float3 ray,
+    float step)
+{
+    if (read_imagef(Occ, samp_ni, occ_tex(Occ, cell, pos)).x > RHO_EPS) {
+        return 0;
+    }
+    return max(1, (int) ceil(cell_exit(pos, ray, cell) / step));
+}
+
 float3 trace_to_light(
     image3d_t T,
+    image3d_t Occ,
+    __global const int *bbox,
     image2d_t Spec,
     const struct Light *light,
     float3 pos0)
 {
-    float3 dir = normalize(light->pos - pos0) * dsl;
+    float3 ray = normalize(light->pos - pos0);
+    float3 dir = ray * dsl;
     float3 pos = pos0 + dir;
     float tx = 1.0f;
 
-    for (int i = 0; i < nlsamp; i++) {
-        float rho = read_imagef(T, samp_n, to4f(pos)).y;
-        tx *= 1.0f - rho * dsl * absorption;
-        if (tx < TX_EPS) break;
+    // nothing to absorb past the occupied bounding box
+    const float cell = macro_size(T);
+    float t0, t1;
+    int n = 0;
+    if (clip_ray(bbox, cell, pos, ray, &t0, &t1)) {
+        n = min(nlsamp, (int) ceil(t1 / dsl) + 1);
+    }
+
+    for (int i = 0; i < n; ) {
+        int k = skip_empty(Occ, cell, pos, ray, dsl);
+        if (k == 0) {
+            float rho = read_imagef(T, samp_n, tex(T, pos)).y;
+            tx *= 1.0f - rho * dsl * absorption;
+            if (tx < TX_EPS) break;
+            k = 1;
+        }
 
-        pos += dir;
+        i += k;
+        pos += k * dir;
     }
 
     return tx * light->intensity;
 }
 
-void __kernel render(
-    const struct Camera cam,
+// Light reaching every voxel, one shadow ray each, so rendering can look it
+// up instead of tracing per sample. Voxels outside the occupied box (plus
+// the interpolation border) are never looked up.
+void __kernel light_volume(
     const struct Light light,
     __read_only image3d_t T,
-    __read_only image3d_t B,
-    __read_only image3d_t BN,
+    __read_only image3d_t Occ,
+    __global const int *bbox,
     __read_only image2d_t Spec,
-    __write_only image2d_t img)
+    __write_only image3d_t Lvol)
 {
-    int2 imgPos = {get_global_id(0), get_global_id(1)};
+    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    if (outside(pos, grid_dims(T))) return;
+    float3 Li = (float3)(light.intensity);
+
+    int3 lo = (int3)(bbox[0], bbox[1], bbox[2]) * MACRO - 1,
+         hi = (int3)(bbox[3] + 1, bbox[4] + 1, bbox[5] + 1) * MACRO;
+    if (bbox[0] <= bbox[3] && all(pos >= lo) && all(pos <= hi)) {
+        float3 p = (convert_float3(pos) + 0.5f) * voxel_size(Lvol);
+        Li = trace_to_light(T, Occ, bbox, Spec, &light, p);
+    }
 
-    float3 pos = {1.0f*imgPos.x/cam.size.x, 1.0f*imgPos.y/cam.size.y, 0};
-    float3 dir = normalize(pos - cam.pos) * ds;
+    wx(Lvol, pos, (float4)(Li.x, 0, 0, 0));
+}
 
-    float tx = 1.0f;      // transmittance along ray
-    float3 Lo = 0.0f;     // total light output from ray
+// light arriving at pos: from the light volume if there is one (lightvol),
+// otherwise traced
+inline float3 light_at(
+    image3d_t T,
+    image3d_t Occ,
+    __global const int *bbox,
+    image2d_t Spec,
+    image3d_t Lvol,
+    uint lightvol,
+    const struct Light *light,
+    float3 pos)
+{
+    if (lightvol) {
+        float4 c = to4f(pos / voxel_size(Lvol));
+        return (float3)(read_imagef(Lvol, samp_f, c).x);
+    }
+    return trace_to_light(T, Occ, bbox, Spec, light, pos);
+}
 
-    int i, j;
-    float3 bg = {0.5f, 0.5f, 0.9f};
-    for (i = 0; i < nsamp; i++) {
-        if (read_imageui(B, samp_ni, to4f(pos)).x == 1) {
-            float3 Li = trace_to_light(T, Spec, &light, pos);
-
-            // diffuse reflection
-            float3 L = normalize(light.pos - pos);
-            float3 N = read_imagef(BN, samp_n, to4f(pos)).xyz;
-            float3 C = (float3)(0.28f, 0.36f, 0.41f);
-            bg = dot(L, N) * C * Li * 0.8f;
-            break;
-        }
+// light arriving at the camera through image-plane point pix (in pixels,
+// not flipped), with every sample moved jitter steps along the ray
+inline float3 march(
+    const struct Camera *cam,
+    const struct Light *light,
+    image3d_t T,
+    image3d_t B,
+    image3d_t BN,
+    image2d_t Spec,
+    image3d_t Occ,
+    __global const int *bbox,
+    image3d_t Lvol,
+    uint lightvol,
+    float2 pix,
+    float jitter)
+{
+    // the image plane is the grid's front face, with square pixels
+    float3 ext = grid_extent(T);
+    float s = max(ext.x / cam->size.x, ext.y / cam->size.y);
+    float2 origin = 0.5f * (ext.xy - s * convert_float2(cam->size));
 
-        float4 Tsamp = read_imagef(T, samp_n, to4f(pos));
-        float rho = Tsamp.y;
-        if (rho > RHO_EPS) {
-            tx *= 1.0f - rho * ds * absorption;
-            if (tx < TX_EPS) break;
+    float3 pos = (float3)(origin + s * pix, 0.0f);
+    float3 ray = normalize(pos - cam->pos);
+    float3 dir = ray * ds;
+    pos += jitter * dir;
 
-            // incident light from light source (attenuated)
-            float3 Li = trace_to_light(T, Spec, &light, pos);
+    float tx = 1.0f;      // transmittance along ray
+    float3 Lo = 0.0f;     // total light output from ray
 
-            // blackbody radiation
-            float4 bb = getBlackbody(Spec, Tsamp.x);
-            float3 Le = bb.xyz * bb.w * 0.7f;
+    // only march the part of the ray inside the occupied bounding box,
+    // keeping samples on the same ds lattice
+    const float cell = macro_size(T);
+    int i = 0, iend = 0;
+    float t0, t1;
+    if (clip_ray(bbox, cell, pos, ray, &t0, &t1)) {
+        i = (int) floor(t0 / ds);
+        iend = min(nsamp, (int) ceil(t1 / ds) + 1);
+        pos += i * dir;
+    }
 
-            Lo += (Li + Le * tx) * rho * ds;
+    float3 bg = {0.5f, 0.5f, 0.9f};
+    while (i < iend) {
+        // empty macro-cells can't contribute: jump over them in whole steps
+        int k = skip_empty(Occ, cell, pos, ray, ds);
+        if (k > 0) {
+            i += k;
+            pos += k * dir;
+        } else {
+            if (read_imageui(B, samp_ni, tex(B, pos)).x == 1) {
+                float3 Li = light_at(T, Occ, bbox, Spec, Lvol, lightvol,
+                                     light, pos);
+
+                // diffuse reflection
+                float3 L = normalize(light->pos - pos);
+                float3 N = read_imagef(BN, samp_n, tex(BN, pos)).xyz;
+                float3 C = (float3)(0.28f, 0.36f, 0.41f);
+                bg = dot(L, N) * C * Li * 0.8f;
+                break;
+            }
+
+            float4 Tsamp = read_imagef(T, samp_n, tex(T, pos));
+            float rho = Tsamp.y;
+            if (rho > RHO_EPS) {
+                tx *= 1.0f - rho * ds * absorption;
+                if (tx < TX_EPS) break;
+
+                // incident light from light source (attenuated)
+                float3 Li = light_at(T, Occ, bbox, Spec, Lvol, lightvol,
+                                     light, pos);
+
+                // blackbody radiation
+                float4 bb = getBlackbody(Spec, Tsamp.x);
+                float3 Le = bb.xyz * bb.w * 0.7f;
+
+                Lo += (Li + Le * tx) * rho * ds;
+            }
+
+            i++;
+            pos += dir;
         }
 
-        pos += dir;
-
         // terminate if out-of-bounds
-        if (pos.x < 0.0f || pos.x > 1.0f
-         || pos.y < 0.0f || pos.y > 1.0f
-         || pos.z < 0.0f || pos.z > 1.0f) {
+        if (pos.x < 0.0f || pos.x > ext.x
+         || pos.y < 0.0f || pos.y > ext.y
+         || pos.z < 0.0f || pos.z > ext.z) {
             break;
         }
     }
 
-    float3 color = Lo + tx * bg;
+    return Lo + tx * bg;
+}
+
+void __kernel render(
+    const struct Camera cam,
+    const struct Light light,
+    __read_only image3d_t T,
+    __read_only image3d_t B,
+    __read_only image3d_t BN,
+    __read_only image2d_t Spec,
+    __read_only image3d_t Occ,
+    __global const int *bbox,
+    __read_only image3d_t Lvol,     // light volume (any image if !lightvol)
+    const uint lightvol,
+    __write_only image2d_t img)
+{
+    int2 imgPos = {get_global_id(0), get_global_id(1)};
+    // the launch is padded to whole workgroups
+    if (imgPos.x >= cam.size.x || imgPos.y >= cam.size.y) {
+        return;
+    }
+
+    float3 color = march(&cam, &light, T, B, BN, Spec, Occ, bbox, Lvol,
+                         lightvol, convert_float2(imgPos), 0.0f);
 
     uint4 rgba = {convert_uint3(color*255), 255};
     write_imageui(img, (int2)(imgPos.x, cam.size.y-1-imgPos.y), rgba);
 }
 
+// Progressive preview: each pass adds one sample per pixel of a reduced
+// cam to accum (rgb, and the count in w; pass 0 starts over), at a new
+// sub-pixel position and ray offset, so a few passes of a build with fewer
+// samples approach the full render.
+void __kernel render_preview(
+    const struct Camera cam,
+    const struct Light light,
+    __read_only image3d_t T,
+    __read_only image3d_t B,
+    __read_only image3d_t BN,
+    __read_only image2d_t Spec,
+    __read_only image3d_t Occ,
+    __global const int *bbox,
+    __read_only image3d_t Lvol,
+    const uint lightvol,
+    const uint pass,
+    __global float4 *accum)
+{
+    int2 imgPos = {get_global_id(0), get_global_id(1)};
+    if (imgPos.x >= cam.size.x || imgPos.y >= cam.size.y) {
+        return;
+    }
+
+    // R2 sequence over passes, shifted per pixel (integer hash) so
+    // neighbouring pixels don't share a pattern
+    uint h = (imgPos.x * 73856093u) ^ (imgPos.y * 19349663u);
+    h = (h ^ (h >> 13)) * 0x5bd1e995u;
+    float r = (h ^ (h >> 15)) * (1.0f / 4294967296.0f);
+    float3 whole,
+           j = fract((float3)(0.7548777f, 0.5698403f, 0.6180340f) * pass + r,
+                     &whole);
+
+    float3 color = march(&cam, &light, T, B, BN, Spec, Occ, bbox, Lvol,
+                         lightvol, convert_float2(imgPos) + j.xy, j.z);
+
+    int idx = imgPos.y * cam.size.x + imgPos.x;
+    float4 sum = pass ? accum[idx] : (float4)(0.0f);
+    accum[idx] = sum + (float4)(color, 1.0f);
+}
+
+// the mean of each accum pixel (size of them), bilinearly upsampled to img
+void __kernel preview_resolve(
+    const uint2 size,
+    __global const float4 *accum,
+    const uint2 outSize,
+    __write_only image2d_t img)
+{
+    int2 outPos = {get_global_id(0), get_global_id(1)};
+    if (outPos.x >= outSize.x || outPos.y >= outSize.y) {
+        return;
+    }
+
+    // accum pixels average around their centres
+    float2 p = (convert_float2(outPos) + 0.5f) * convert_float2(size)
+             / convert_float2(outSize) - 0.5f;
+    p = clamp(p, 0.0f, convert_float2(size) - 1.0f);
+    int2 p0 = convert_int2(p),
+         p1 = min(p0 + 1, convert_int2(size) - 1);
+    float2 f = p - convert_float2(p0);
+
+    float4 c00 = accum[p0.y * size.x + p0.x], c10 = accum[p0.y * size.x + p1.x],
+           c01 = accum[p1.y * size.x + p0.x], c11 = accum[p1.y * size.x + p1.x];
+    float3 color = mix(mix(c00.xyz / c00.w, c10.xyz / c10.w, f.x),
+                       mix(c01.xyz / c01.w, c11.xyz / c11.w, f.x), f.y);
+
+    uint4 rgba = {convert_uint3(clamp(color, 0.0f, 1.0f) * 255), 255};
+    write_imageui(img, (int2)(outPos.x, outSize.y-1-outPos.y), rgba);
+}
+
 
 void __kernel render_slice(
     const struct Camera cam,
@@ -119,11 +421,16 @@ void __kernel render_slice(
     __read_only image3d_t B,
     __read_only image3d_t BN,
     __read_only image2d_t Spec,
+    __read_only image3d_t Occ,
+    __global const int *bbox,
+    __read_only image3d_t Lvol,
+    const uint lightvol,
     __write_only image2d_t img)
 {
     int2 pos = {get_global_id(0), get_global_id(1)};
-    float2 fpos = convert_float2(pos) * get_image_width(T) / cam.size.x;
-    float4 sp = (float4)(fpos, 64, 0);
+    int3 n = grid_dims(T);
+    float2 fpos = convert_float2(pos) * n.x / cam.size.x;
+    float4 sp = (float4)(fpos, n.z / 2, 0);
     uint b = read_imageui(B, samp_f, sp).x;
     uint4 color = {0, 0, 0, 255};
 
@@ -209,9 +516,10 @@ inline uint4 ixu(image3d_t img, int3 c) {
 
 void __kernel gen_normals(
     __read_only image3d_t B,
-    __write_only image3d_t BN)
+    __write_only image3d_t BN,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 pos = grid_pos(bricks);
     if (ixu(B, pos).x != 1) {
         wx(BN, pos, (float4)(1));
         return;
@@ -0,0 +1,150 @@
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <poll.h>
+#include <sstream>
+
+#include "output.h"
+#include "run.h"
+
+static void printStatus(const char *what, int i, int n, float t) {
+    const auto spaces = std::string(80, ' ');
+    static bool first = true;
+    if (first) {
+        std::cout << std::endl << std::setprecision(2) << std::fixed;
+        first = false;
+    }
+
+    std::cout << "\r" << spaces << "\r"
+        << what << ": frame " << i+1 << "/" << n << ", t=" << t << "   ";
+    std::cout.flush();
+}
+
+int runFrames(Scene &scene, Backend &sim, Profiler *prof,
+    const RunOptions &opts)
+{
+    std::vector<cl_uint2> sizes;
+    for (auto &cam : scene.cams) {
+        sizes.push_back(cam.size);
+    }
+    FrameWriter writer(opts.outDir, sizes, opts.encThreads, opts.queueDepth,
+        prof, opts.sink);
+    std::unique_ptr<VolumeWriter> volumes(scene.params.exports
+        ? new VolumeWriter(opts.outDir, opts.encThreads, opts.queueDepth, prof)
+        : NULL);
+
+    int nsteps = scene.params.nsteps;
+    int first = opts.restoreFile.empty() ? 0
+        : sim.loadCheckpoint(opts.restoreFile);
+    std::unique_ptr<VolumeReader> replay(opts.replayDir.empty() ? NULL
+        : new VolumeReader(opts.replayDir, first, nsteps, prof));
+    for (int i = first; i < nsteps; i++) {
+        if (prof) {
+            prof->setFrame(i);
+        }
+
+        if (replay) {
+            sim.loadVolume(replay->next());
+        }
+
+        // blocks if all frame buffers are still being encoded
+        FrameWriter::Frame &frame = writer.acquire();
+        sim.render(frame);
+        writer.submit(frame, i);
+        if (volumes) {
+            VolumeFrame &vol = volumes->acquire();
+            sim.exportVolume(vol);
+            volumes->submit(vol, i);
+        }
+
+        if (!replay) {
+            sim.advance();
+        }
+
+        if (opts.checkpointEvery > 0 && (i+1) % opts.checkpointEvery == 0) {
+            std::ostringstream fname;
+            fname << opts.outDir << "/checkpoint-" << std::setfill('0')
+                << std::setw(4) << i+1 << ".bin";
+            sim.saveCheckpoint(fname.str(), i+1);
+        }
+
+        if (opts.status) {
+            printStatus(replay ? "Rendering" : "Simulating", i, nsteps,
+                sim.getT());
+        }
+    }
+    writer.finish();
+    if (volumes) {
+        volumes->finish();
+    }
+    return nsteps - first;
+}
+
+// a whole line is waiting on stdin
+static bool inputReady() {
+    if (std::cin.rdbuf()->in_avail() > 0) {
+        return true;
+    }
+    struct pollfd fd = {0, POLLIN, 0};
+    return poll(&fd, 1, 0) > 0;
+}
+
+int runPreview(Scene &scene, Backend &sim, const RunOptions &opts) {
+    std::vector<std::unique_ptr<HostImage>> owned;
+    std::vector<HostImage *> imgs;
+    for (auto &cam : scene.cams) {
+        owned.emplace_back(new HostImage(cam.size.s[0], cam.size.s[1]));
+        imgs.push_back(owned.back().get());
+    }
+
+    std::cout << "Preview at 1/" << opts.previewScale << " resolution, into "
+        << opts.outDir << "/preview-N.png\n"
+        << "Enter: next frame, <n>: n frames, w: write now, q: quit\n"
+        << std::setprecision(2) << std::fixed;
+    auto writeAll = [&] {
+        for (size_t v = 0; v < imgs.size(); v++) {
+            imgs[v]->write(opts.outDir + "/preview-" + std::to_string(v)
+                + ".png");
+        }
+    };
+    int frames = 0, pass = 0;
+    auto t0 = time_now();
+    while (true) {
+        // refine until there's a command or nothing left to add
+        if (pass < opts.previewPasses && !inputReady()) {
+            sim.preview(imgs, opts.previewScale, pass);
+            for (auto img : imgs) {
+                img->sync();
+            }
+            pass++;
+            // PNGs at full size take longer than a pass; only the final
+            // image is written unless asked for
+            if (pass == opts.previewPasses) {
+                writeAll();
+            }
+            std::cout << "\r" << std::string(60, ' ') << "\rt=" << sim.getT()
+                << ", pass " << pass << "/" << opts.previewPasses << ", "
+                << 1e3 * time_since(t0) << " ms";
+            std::cout.flush();
+            continue;
+        }
+
+        std::string line;
+        if (!std::getline(std::cin, line) || line == "q") {
+            break;
+        }
+        if (line == "w") {
+            writeAll();
+            continue;
+        }
+        int n = line.empty() ? 1 : atoi(line.c_str());
+        for (int i = 0; i < n; i++) {
+            sim.advance();
+        }
+        frames += std::max(n, 0);
+        pass = 0;
+        t0 = time_now();
+    }
+    std::cout << "\n";
+    return frames;
+}
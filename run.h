@@ -0,0 +1,47 @@
+/* -*- C++ -*- */
+
+#ifndef __RUN_H__
+#define __RUN_H__
+
+#include <string>
+
+#include "backend.h"
+#include "profiler.h"
+#include "scene.h"
+
+struct RunOptions {
+    RunOptions() :
+        outDir("output"),
+        encThreads(0),
+        queueDepth(0),
+        checkpointEvery(0),
+        status(true),
+        previewScale(0),
+        previewPasses(16),
+        sink("png") {}
+
+    std::string outDir;         // frames, volumes and checkpoints
+    unsigned encThreads;        // PNG/volume encoder threads, 0 = all cores
+    unsigned queueDepth;        // max frames buffered, 0 = threads+2
+    int checkpointEvery;        // frames between checkpoints, 0 = never
+    std::string restoreFile;    // checkpoint to resume from
+    std::string replayDir;      // re-render volumes from here, don't simulate
+    bool status;                // print a progress line every frame
+    int previewScale;           // runPreview's resolution divisor
+    int previewPasses;          // refinement passes per preview
+    std::string sink;           // where frames go, see makeFrameSink()
+};
+
+// render (and simulate) the scene's frames and write them out; returns the
+// number of frames done
+int runFrames(Scene &scene, Backend &sim, Profiler *prof,
+    const RunOptions &opts);
+
+// interactive look development: steps frames as asked on stdin (a blank
+// line for one, a number for that many, q to stop), and while waiting
+// refines a preview (see Backend::preview); the last pass, or whatever
+// there is on w, goes to <outDir>/preview-N.png, one per camera; returns
+// the number of frames stepped
+int runPreview(Scene &scene, Backend &sim, const RunOptions &opts);
+
+#endif // __RUN_H__
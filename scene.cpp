@@ -1,15 +1,79 @@
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 
 #include "scene.h"
+#include "objects.h"
 
-Scene::Scene(char *fname) : in(fname) {
-    if (!in.is_open()) {
+// comma-separated grid names, "all" or "none"
+static unsigned parseFields(const std::string &list) {
+    if (list == "all") {
+        return FIELD_ALL;
+    } else if (list == "none") {
+        return 0;
+    }
+
+    unsigned fields = 0;
+    std::stringstream ss(list);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        if (name == "U") {
+            fields |= FIELD_U;
+        } else if (name == "T") {
+            fields |= FIELD_T;
+        } else if (name == "P") {
+            fields |= FIELD_P;
+        } else if (name == "Dvg") {
+            fields |= FIELD_DVG;
+        } else if (name == "Curl") {
+            fields |= FIELD_CURL;
+        } else if (name == "BN") {
+            fields |= FIELD_BN;
+        } else {
+            std::cerr << "Error: unknown grid '" << name << "'\n";
+            exit(1);
+        }
+    }
+    return fields;
+}
+
+// comma-separated T channel names, "all" or "none"
+static unsigned parseChannels(const std::string &list) {
+    if (list == "all") {
+        return EXPORT_ALL;
+    } else if (list == "none") {
+        return 0;
+    }
+
+    unsigned channels = 0;
+    std::stringstream ss(list);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        if (name == "temp") {
+            channels |= EXPORT_TEMP;
+        } else if (name == "smoke") {
+            channels |= EXPORT_SMOKE;
+        } else if (name == "fuel") {
+            channels |= EXPORT_FUEL;
+        } else {
+            std::cerr << "Error: unknown channel '" << name << "'\n";
+            exit(1);
+        }
+    }
+    return channels;
+}
+
+Scene::Scene(const std::string &fname, const std::string &overrides) {
+    std::ifstream file(fname);
+    if (!file.is_open()) {
         std::cerr << "Error: couldn't open scene file '" << fname << "'\n";
         exit(1);
     }
+    std::stringstream text;
+    text << file.rdbuf() << "\n" << overrides;
+    in.str(text.str());
 
     while (!in.eof()) {
         auto tok = getToken();
@@ -31,8 +95,34 @@ Scene::Scene(char *fname) : in(fname) {
         }
     }
 
-    // "null" object
-    objects.push_back({{-1,-1,-1}, {-1, -1, -1}});
+    if (cams.empty()) {
+        cams.push_back(Camera());
+    }
+
+    // "null" object, so the buffer is never empty
+    objects.push_back(Object());
+}
+
+void Scene::rescale(int n) {
+    if (n <= 0) {
+        std::cerr << "Error: grid size must be positive\n";
+        exit(1);
+    }
+    int *dims[3] = {&params.grid_x, &params.grid_y, &params.grid_z};
+    const float s = (float) n
+        / std::max(params.grid_x, std::max(params.grid_y, params.grid_z));
+    for (auto d : dims) {
+        *d = std::max(1, (int) std::lround(*d * s));
+    }
+
+    // grid coords (a sphere's radius included) scale as the grid does
+    for (auto &obj : objects) {
+        for (int i = 0; i < 3; i++) {
+            obj.v0.s[i] *= s;
+            obj.v1.s[i] *= s;
+            obj.v2.s[i] *= s;
+        }
+    }
 }
 
 void Scene::parseSimParams() {
@@ -41,11 +131,22 @@ void Scene::parseSimParams() {
         auto tok = getToken();
         if (tok == "grid") {
             int n = getInt();
-            if (n % 8) {
-                std::cerr << "Error: grid size must be multiple of 8\n";
+            if (n <= 0) {
+                std::cerr << "Error: grid size must be positive\n";
                 exit(1);
             }
-            params.grid_n = n;
+            params.grid_x = params.grid_y = params.grid_z = n;
+        } else if (tok == "dims") {
+            int nx = getInt(),
+                ny = getInt(),
+                nz = getInt();
+            if (nx <= 0 || ny <= 0 || nz <= 0) {
+                std::cerr << "Error: grid dimensions must be positive\n";
+                exit(1);
+            }
+            params.grid_x = nx;
+            params.grid_y = ny;
+            params.grid_z = nz;
         } else if (tok == "dt") {
             params.dt = getFloat();
         } else if (tok == "nsteps") {
@@ -54,6 +155,92 @@ void Scene::parseSimParams() {
             params.niters = getInt();
         } else if (tok == "walls") {
             params.walls = getInt();
+        } else if (tok == "solver") {
+            auto name = getToken();
+            if (name == "jacobi") {
+                params.solver = SOLVER_JACOBI;
+            } else if (name == "multigrid") {
+                params.solver = SOLVER_MULTIGRID;
+            } else {
+                std::cerr << "Error: unknown pressure solver '" << name << "'\n";
+                exit(1);
+            }
+        } else if (tok == "tolerance") {
+            params.tolerance = getFloat();
+        } else if (tok == "maxcycles") {
+            params.maxcycles = getInt();
+        } else if (tok == "backend") {
+            auto name = getToken();
+            if (name == "opencl") {
+                params.backend = BACKEND_OPENCL;
+            } else if (name == "cpu") {
+                params.backend = BACKEND_CPU;
+            } else {
+                std::cerr << "Error: unknown backend '" << name << "'\n";
+                exit(1);
+            }
+        } else if (tok == "threads") {
+            params.threads = getInt();
+        } else if (tok == "seed") {
+            params.seed = getInt();
+        } else if (tok == "overlap") {
+            params.overlap = getInt();
+        } else if (tok == "fused") {
+            auto mode = getToken();
+            if (mode == "0") {
+                params.fused = FUSED_OFF;
+            } else if (mode == "1") {
+                params.fused = FUSED_ON;
+            } else if (mode == "check") {
+                params.fused = FUSED_CHECK;
+            } else {
+                std::cerr << "Error: fused must be 0, 1 or check\n";
+                exit(1);
+            }
+        } else if (tok == "sparse") {
+            params.sparse = getInt();
+        } else if (tok == "margin") {
+            params.margin = getInt();
+        } else if (tok == "lightvol") {
+            params.lightvol = getInt();
+        } else if (tok == "samples") {
+            params.samples = getInt();
+            if (params.samples < 1) {
+                std::cerr << "Error: samples must be at least 1\n";
+                exit(1);
+            }
+        } else if (tok == "lightsamples") {
+            params.lightsamples = getInt();
+            if (params.lightsamples < 1) {
+                std::cerr << "Error: lightsamples must be at least 1\n";
+                exit(1);
+            }
+        } else if (tok == "half") {
+            params.half = parseFields(getToken());
+        } else if (tok == "halfcheck") {
+            params.halfcheck = getInt();
+        } else if (tok == "export") {
+            params.exports = parseChannels(getToken());
+        } else if (tok == "exportcheck") {
+            params.exportcheck = getInt();
+        } else if (tok == "cfl") {
+            params.cfl = getFloat();
+        } else if (tok == "maxsubsteps") {
+            params.maxsubsteps = getInt();
+            if (params.maxsubsteps < 1) {
+                std::cerr << "Error: maxsubsteps must be at least 1\n";
+                exit(1);
+            }
+        } else if (tok == "slabs") {
+            params.slabs = getInt();
+            if (params.slabs < 1) {
+                std::cerr << "Error: slabs must be at least 1\n";
+                exit(1);
+            }
+        } else if (tok == "slabcheck") {
+            params.slabcheck = getInt();
+        } else if (tok == "autotune") {
+            params.autotune = getInt();
         } else if (tok == "}") {
             break;
         } else {
@@ -65,6 +252,8 @@ void Scene::parseSimParams() {
 
 void Scene::parseCamera() {
     expect("{");
+    cams.push_back(Camera());
+    Camera &cam = cams.back();
     while (true) {
         auto tok = getToken();
         if (tok == "pos") {
@@ -72,8 +261,8 @@ void Scene::parseCamera() {
         } else if (tok == "size") {
             unsigned x = getInt(),
                      y = getInt();
-            if (x % 16 || y % 16) {
-                std::cerr << "Error: image dimensions must be multiple of 16\n";
+            if (x == 0 || y == 0) {
+                std::cerr << "Error: image dimensions must be positive\n";
                 exit(1);
             }
             cam.size = {x, y};
@@ -123,14 +312,24 @@ void Scene::parseExplosion() {
 }
 
 void Scene::parseObject() {
-    Object obj;
+    std::string shape = "box", mesh;
+    cl_float3 pos = {0, 0, 0}, dim = {0, 0, 0};
+    float radius = 0.0f, scale = 1.0f;
     expect("{");
     while (true) {
         auto tok = getToken();
-        if (tok == "pos") {
-            obj.pos = getFloat3();
+        if (tok == "shape") {
+            shape = getToken();
+        } else if (tok == "pos") {
+            pos = getFloat3();
         } else if (tok == "dim") {
-            obj.dim = getFloat3();
+            dim = getFloat3();
+        } else if (tok == "radius") {
+            radius = getFloat();
+        } else if (tok == "mesh") {
+            mesh = getToken();
+        } else if (tok == "scale") {
+            scale = getFloat();
         } else if (tok == "}") {
             break;
         } else {
@@ -139,12 +338,39 @@ void Scene::parseObject() {
         }
     }
 
-    // convert centered pos to lower-left pos
-    obj.pos.x -= 0.5 * obj.dim.x;
-    obj.pos.y -= 0.5 * obj.dim.y;
-    obj.pos.z -= 0.5 * obj.dim.z;
-
-    objects.push_back(obj);
+    Object obj = Object();
+    if (shape == "box") {
+        // pos is the center
+        obj.shape = SHAPE_BOX;
+        for (int i = 0; i < 3; i++) {
+            obj.v0.s[i] = pos.s[i] - 0.5f * dim.s[i];
+            obj.v1.s[i] = pos.s[i] + 0.5f * dim.s[i];
+        }
+        objects.push_back(obj);
+    } else if (shape == "sphere") {
+        obj.shape = SHAPE_SPHERE;
+        obj.v0 = pos;
+        obj.v1.s[0] = radius;
+        objects.push_back(obj);
+    } else if (shape == "mesh") {
+        // mesh coords are scaled, then moved to pos
+        if (mesh.empty()) {
+            std::cerr << "Error: mesh Object without a mesh file\n";
+            exit(1);
+        }
+        for (auto &tri : loadMesh(mesh)) {
+            for (int i = 0; i < 3; i++) {
+                obj.v0.s[i] = pos.s[i] + scale * tri.v0.s[i];
+                obj.v1.s[i] = pos.s[i] + scale * tri.v1.s[i];
+                obj.v2.s[i] = pos.s[i] + scale * tri.v2.s[i];
+            }
+            obj.shape = SHAPE_TRIANGLE;
+            objects.push_back(obj);
+        }
+    } else {
+        std::cerr << "Error: unknown Object shape '" << shape << "'\n";
+        exit(1);
+    }
 }
 
 std::string Scene::getToken() {
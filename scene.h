@@ -3,22 +3,118 @@
 #ifndef __SCENE_H__
 #define __SCENE_H__
 
-#include <fstream>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <CL/cl.hpp>
 
+enum PressureSolver { SOLVER_JACOBI, SOLVER_MULTIGRID };
+enum SimBackend { BACKEND_OPENCL, BACKEND_CPU };
+enum FusedMode { FUSED_OFF, FUSED_ON, FUSED_CHECK };
+
+// grids that can be stored as half floats
+enum GridField { FIELD_U = 1, FIELD_T = 2, FIELD_P = 4, FIELD_DVG = 8,
+    FIELD_CURL = 16, FIELD_BN = 32, FIELD_ALL = 63 };
+
+// channels of T that can be exported
+enum ExportChannel { EXPORT_TEMP = 1, EXPORT_SMOKE = 2, EXPORT_FUEL = 4,
+    EXPORT_ALL = 7 };
+
 struct SimParams {
     SimParams() :
-        grid_n(128),
+        grid_x(128),
+        grid_y(128),
+        grid_z(128),
         nsteps(100),
         niters(30),
         dt(0.04),
-        walls(true) {}
-
-    int grid_n;
+        walls(true),
+        solver(SOLVER_JACOBI),
+        tolerance(1e-3),
+        maxcycles(8),
+        backend(BACKEND_OPENCL),
+        threads(0),
+        seed(0),
+        overlap(false),
+        fused(FUSED_OFF),
+        sparse(false),
+        margin(1),
+        lightvol(false),
+        samples(256),
+        lightsamples(96),
+        half(0),
+        halfcheck(0),
+        exports(0),
+        exportcheck(0),
+        cfl(0),
+        maxsubsteps(8),
+        slabs(1),
+        slabcheck(0),
+        autotune(true) {}
+
+    // grid dimensions; the longest side spans [0, 1] in world coords
+    int grid_x, grid_y, grid_z;
     int nsteps, niters;
-    float dt;
+    float dt;           // frame interval, and step size unless cfl is set
     cl_uint walls;
+
+    // pressure solve
+    PressureSolver solver;
+    float tolerance;    // multigrid: target relative residual
+    int maxcycles;      // multigrid: max V-cycles per solve
+
+    SimBackend backend;
+    int threads;        // CPU backend worker threads, 0 = all cores
+    unsigned seed;      // explosion RNG seed, 0 = time-based
+
+    // render from a snapshot of T on a second queue, concurrently with the
+    // next simulation step
+    bool overlap;
+
+    // fused step kernels; FUSED_CHECK also runs the unfused path every step
+    // and reports the difference
+    FusedMode fused;
+
+    // only simulate 8x8x4 bricks near something non-empty, refreshed every
+    // step and grown by margin bricks in each direction
+    bool sparse;
+    int margin;
+
+    // shade from a light transmittance volume computed once per frame,
+    // instead of a shadow ray per sample
+    bool lightvol;
+
+    // ray-march samples across the unit cube diagonal, for camera rays and
+    // for shadow rays
+    int samples, lightsamples;
+
+    // GridField bits stored as CL_HALF_FLOAT (kernels still compute in
+    // float); halfcheck compares against a float run every n steps
+    unsigned half;
+    int halfcheck;
+
+    // ExportChannel bits written to output/volume-NNNN.vol every frame,
+    // non-empty bricks only; exportcheck loads them into a second run every
+    // n frames and compares T, which should match exactly in the exported
+    // channels (OpenCL backend, no slabs)
+    unsigned exports;
+    int exportcheck;
+
+    // adaptive time step: split each frame into equal steps that move
+    // nothing more than cfl cells, up to maxsubsteps of them; 0 = off
+    float cfl;
+    int maxsubsteps;
+
+    // split the grid into this many z-slabs, one per OpenCL device (CPU
+    // devices are partitioned to make up the number); 1 = off. slabcheck
+    // compares against an unsplit run every n frames, and lets slabs share
+    // a device, so that one is enough to check
+    int slabs;
+    int slabcheck;
+
+    // time candidate workgroup shapes per kernel on first launch, and keep
+    // the fastest in the tuning cache (see tuner.h)
+    bool autotune;
 };
 
 struct Camera {
@@ -52,25 +148,41 @@ struct Explosion {
     unsigned subex;
 } __attribute__ ((packed));
 
-// rectangular prisms only
+enum ObjectShape {
+    SHAPE_BOX,
+    SHAPE_SPHERE,
+    SHAPE_TRIANGLE
+};
+
+// an obstacle in grid coordinates: a box with corners v0 and v1, a sphere
+// around v0 with radius v1.x, or a triangle v0 v1 v2 (from a mesh),
+// voxelized as a watertight shell
 struct Object {
-    cl_float3 pos, dim;
+    cl_float3 v0, v1, v2;
+    cl_uint shape;
+    cl_uint _1, _2, _3;     // pad to 64 bytes
 } __attribute__ ((packed));
 
 class Scene {
 public:
-    Scene(char *fname);
+    // overrides is more scene text, parsed after the file; SimParam,
+    // Explosion and Light blocks there replace the values they name
+    Scene(const std::string &fname, const std::string &overrides="");
+
+    // resize the grid so its longest side is n cells, keeping its shape,
+    // and scale the objects with it; everything in world coords stays as it is
+    void rescale(int n);
 
     // scene description
     SimParams params;
-    Camera cam;
+    std::vector<Camera> cams;   // one rendered view per Camera block
     Light light;
     Explosion explosion;
-    std::vector<Object> objects;
+    std::vector<Object> objects;  // ends with a "null" object
 
 private:
     // for parsing
-    std::ifstream in;
+    std::istringstream in;
 
     void parseSimParams();
     void parseCamera();
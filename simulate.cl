@@ -24,10 +24,15 @@ __constant sampler_t samp_ni =
     CLK_FILTER_NEAREST;
 
 
+// CELL_SIZE in backend.h; scene builds set it
+#ifndef CELL_H
+#define CELL_H      0.25f
+#endif
+
 // convention: c* = coefficient, t* = temperature, r* = rate
 __constant const float
     // general constants
-    h           = 0.25f,     // cell side length (m)
+    h           = CELL_H,    // cell side length (m)
     hinv        = 1.0f/h,   // cells per unit length
     grav        = 9.8f,      // acceleration due to gravity (m/s^2)
     cVort       = 8.0f,     // vorticity confinement
@@ -50,10 +55,21 @@ __constant int3 dx = {1, 0, 0},
                 dy = {0, 1, 0},
                 dz = {0, 0, 1};
 
+// see scene.h
 struct Object {
-    float3 pos, dim;
+    float3 v0, v1, v2;
+    uint shape;
 };
 
+#define SHAPE_BOX 0
+#define SHAPE_SPHERE 1
+#define SHAPE_TRIANGLE 2
+
+// side of an object bin in voxels (see objects.h)
+#ifndef OBJ_BIN
+#define OBJ_BIN 8
+#endif
+
 inline int4 to4i(int3 c) {
 	return (int4)(c, 0);
 }
@@ -72,44 +88,168 @@ inline void wx(image3d_t img, int3 c, float4 v) {
 	write_imagef(img, to4i(c), v);
 }
 
+// size of a cell in world coordinates, where the longest side of the grid
+// spans [0, 1]
+inline float voxel_size(image3d_t img) {
+    int n = max(max(get_image_width(img), get_image_height(img)),
+                get_image_depth(img));
+    return 1.0f / n;
+}
+
+// dims of a full-resolution grid (U, T, B, ...). Scene builds pass them as
+// GRID_NX/NY/NZ, so everything derived from them folds into constants.
+inline int3 grid_dims(image3d_t img) {
+#ifdef GRID_NX
+    return (int3)(GRID_NX, GRID_NY, GRID_NZ);
+#else
+    return (int3)(get_image_width(img), get_image_height(img),
+                  get_image_depth(img));
+#endif
+}
+
+// cell size of a full-resolution grid; GRID_N is the longest side of the
+// whole grid, which a z-slab of it may not contain
+inline float grid_voxel(image3d_t img) {
+#ifdef GRID_N
+    return 1.0f / GRID_N;
+#else
+    int3 n = grid_dims(img);
+    return 1.0f / max(max(n.x, n.y), n.z);
+#endif
+}
+
+// world extent of the grid (img is one of its full-resolution images)
+inline float3 grid_extent(image3d_t img) {
+    return convert_float3(grid_dims(img)) * grid_voxel(img);
+}
+
+// grid position of this work-item. Dense launches cover the whole grid; when
+// a brick list is given, each workgroup along x covers one listed brick.
+inline int3 grid_pos(__global const int4 *bricks) {
+    if (bricks) {
+        int3 lid = {get_local_id(0), get_local_id(1), get_local_id(2)};
+        return bricks[get_group_id(0)].xyz + lid;
+    }
+    return (int3)(get_global_id(0), get_global_id(1), get_global_id(2));
+}
+
+// dense launches are padded to whole workgroups (see Tuner::padded) and
+// bricks at the far faces stick out, so work-items can land outside the
+// n-cell grid; they write nothing
+inline bool outside(int3 pos, int3 n) {
+    return any(pos >= n);
+}
+
+// dims of any grid image, multigrid levels included
+inline int3 image_dims(image3d_t img) {
+    return (int3)(get_image_width(img), get_image_height(img),
+                  get_image_depth(img));
+}
+
+
+// squared distance from p to triangle abc, as triangleDist2 in objects.cpp
+inline float triangle_dist2(float3 p, float3 a, float3 b, float3 c) {
+    float3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = dot(ab, ap), d2 = dot(ac, ap);
+    float u = 0.0f, v = 0.0f;
+    if (d1 > 0.0f || d2 > 0.0f) {
+        float3 bp = p - b, cp = p - c;
+        float d3 = dot(ab, bp), d4 = dot(ac, bp),
+              d5 = dot(ab, cp), d6 = dot(ac, cp);
+        float vc = d1 * d4 - d3 * d2,
+              vb = d5 * d2 - d1 * d6,
+              va = d3 * d6 - d5 * d4;
+        if (d3 >= 0.0f && d4 <= d3) {
+            u = 1.0f;
+        } else if (d6 >= 0.0f && d5 <= d6) {
+            v = 1.0f;
+        } else if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+            u = d1 / (d1 - d3);
+        } else if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+            v = d2 / (d2 - d6);
+        } else if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+            v = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            u = 1.0f - v;
+        } else {
+            float denom = 1.0f / (va + vb + vc);
+            u = vb * denom;
+            v = vc * denom;
+        }
+    }
+    float3 d = p - (a + u * ab + v * ac);
+    return dot(d, d);
+}
 
+// as objectContains in objects.cpp
+inline bool object_contains(__global const struct Object *obj, float3 p) {
+    if (obj->shape == SHAPE_BOX) {
+        return all(p >= obj->v0) && all(p <= obj->v1);
+    } else if (obj->shape == SHAPE_SPHERE) {
+        return distance(p, obj->v0) <= obj->v1.x;
+    }
+    return triangle_dist2(p, obj->v0, obj->v1, obj->v2) <= 0.87f * 0.87f;
+}
+
+// walls: bit 0 for the x and y faces, bits 1 and 2 for the lower and upper
+// z face (clear where a z-slab meets the next one). Objects are in the
+// scene's grid coordinates, and this grid's layer 0 is its layer z0; bins
+// is an ObjectBins index over this grid.
 void __kernel init_grid(
     uint walls,
+    int z0,
     uint nobjs,
     __global const struct Object *objects,
+    __global const uint *bins,
     __write_only image3d_t U,       // velocity
     __write_only image3d_t T,       // thermo
-    __write_only image3d_t B)       // boundaries
+    __write_only image3d_t B,       // boundaries
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
-    wx(U, pos, (float4)(0));
-    wx(T, pos, (float4)(0));
-
+    // (B is write-only, so not grid_dims)
+#ifdef GRID_NX
+    int nx = GRID_NX, ny = GRID_NY, nz = GRID_NZ;
+#else
     int nx = get_image_width(B),
         ny = get_image_height(B),
         nz = get_image_depth(B);
+#endif
+
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, (int3)(nx, ny, nz))) return;
+    wx(U, pos, (float4)(0));
+    wx(T, pos, (float4)(0));
+
+    // scene builds fix these, dropping the loop below when there are no
+    // objects
+#ifdef WALLS
+    walls = WALLS;
+#endif
+#ifdef NOBJS
+    nobjs = NOBJS;
+#endif
 
     // set walls as boundaries
     uint b = 0;
-    if (walls) {
-        if (pos.x == 0 || pos.x == nx-1
-         || pos.y == 0 || pos.y == ny-1
-         || pos.z == 0 || pos.z == nz-1)
-         {
-             b = 2;
-         }
+    if (((walls & 1) && (pos.x == 0 || pos.x == nx-1
+                      || pos.y == 0 || pos.y == ny-1))
+     || ((walls & 2) && pos.z == 0)
+     || ((walls & 4) && pos.z == nz-1))
+    {
+        b = 2;
     }
 
-    // voxelize objects
-    for (int i = 0; i < nobjs; i++) {
-        float3 p = objects[i].pos;
-        float3 dim = objects[i].dim;
-        if (pos.x >= p.x && pos.x <= p.x+dim.x
-         && pos.y >= p.y && pos.y <= p.y+dim.y
-         && pos.z >= p.z && pos.z <= p.z+dim.z)
-         {
-             b = 1;
-         }
+    // voxelize the objects in this voxel's bin
+    if (nobjs > 0) {
+        int3 nb = ((int3)(nx, ny, nz) + OBJ_BIN-1) / OBJ_BIN,
+             bin = pos / OBJ_BIN;
+        int bi = (bin.z * nb.y + bin.y) * nb.x + bin.x;
+        float3 p = (float3)(pos.x, pos.y, pos.z + z0);
+        for (uint i = bins[bi]; i < bins[bi+1]; i++) {
+            if (object_contains(&objects[bins[i]], p)) {
+                b = 1;
+                break;
+            }
+        }
     }
 
     write_imageui(B, to4i(pos), b);
@@ -121,9 +261,11 @@ void __kernel advect(
     __read_only image3d_t U,
     __read_only image3d_t T,
     __write_only image3d_t U_out,
-    __write_only image3d_t T_out)
+    __write_only image3d_t T_out,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
 
     float3 fpos = convert_float3(pos) + 0.5f;
     float3 p0 = fpos - dt * hinv * ix(U, pos).xyz;
@@ -133,12 +275,31 @@ void __kernel advect(
 }
 
 
+// curl from the 6 neighboring velocities (with magnitude as 4th component)
+inline float4 curl_of(
+    float4 x1, float4 x2,
+    float4 y1, float4 y2,
+    float4 z1, float4 z2)
+{
+    float4 curl = {
+        y1.z - y2.z - z1.y + z2.y,
+        z1.x - z2.x - x1.z + x2.z,
+        x1.y - x2.y - y1.x + y2.x,
+        0
+    };
+
+    curl.xyz *= 0.5f * hinv;
+    curl.w = length(curl.xyz);
+    return curl;
+}
+
 void __kernel curl(
     __read_only image3d_t U,
-    __write_only image3d_t Curl)
+    __write_only image3d_t Curl,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
-    int i = pos.x, j = pos.y, k = pos.z;
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
 
     // "prefetch" to avoid unecessary lookups
     float4 x1 = ix(U, pos + dx);
@@ -148,30 +309,17 @@ void __kernel curl(
     float4 z1 = ix(U, pos + dz);
     float4 z2 = ix(U, pos - dz);
 
-    float4 curl = {
-        y1.z - y2.z - z1.y + z2.y,
-        z1.x - z2.x - x1.z + x2.z,
-        x1.y - x2.y - y1.x + y2.x,
-        0
-    };
-
-    curl.xyz *= 0.5f * hinv;
-    curl.w = length(curl.xyz);
-
-    wx(Curl, pos, curl);
+    wx(Curl, pos, curl_of(x1, x2, y1, y2, z1, z2));
 }
 
 
-void __kernel add_forces(
+inline float4 apply_forces(
     const float dt,
-    __read_only image3d_t U,
-    __read_only image3d_t T,
-    __read_only image3d_t Curl,
-    __write_only image3d_t U_out)
+    float4 v,
+    float4 therm,
+    image3d_t Curl,
+    int3 pos)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
-    float4 therm = ix(T, pos);
-
     // force accumulator
     float3 f = 0;
 
@@ -192,23 +340,26 @@ void __kernel add_forces(
     // force = eps * (|eta| x curl U) * dh
     f.xyz += cVort * cross(eta, ix(Curl, pos).xyz) * h;
 
-    float4 v = ix(U, pos);
     v.xyz += dt * f;
-    wx(U_out, pos, v);
+    return v;
 }
 
-
-void __kernel reaction(
+void __kernel add_forces(
     const float dt,
+    __read_only image3d_t U,
     __read_only image3d_t T,
-    __write_only image3d_t T_out,
-    __write_only image3d_t Dvg)
+    __read_only image3d_t Curl,
+    __write_only image3d_t U_out,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
+    wx(U_out, pos, apply_forces(dt, ix(U, pos), ix(T, pos), Curl, pos));
+}
 
-    // x = temperature, y = smoke, z = fuel
-    float4 f = ix(T, pos);
 
+// x = temperature, y = smoke, z = fuel
+inline float4 react(const float dt, float4 f, float *dvg_out) {
     // cooling
     float r  = (f.x - tAmb) / (tMax - tAmb);
     f.x = max(f.x - cCooling * pown(r, 4), tAmb);   // don't go below ambient
@@ -225,25 +376,47 @@ void __kernel reaction(
 
     f.y *= 1.0f - rSmokeDiss;
 
-    wx(T_out, pos, f);
+    *dvg_out = dvg;
+    return f;
+}
+
+void __kernel reaction(
+    const float dt,
+    __read_only image3d_t T,
+    __write_only image3d_t T_out,
+    __write_only image3d_t Dvg,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(T))) return;
+
+    float dvg;
+    wx(T_out, pos, react(dt, ix(T, pos), &dvg));
     wx(Dvg, pos, (float4)(dvg, 0, 0, 0));
 }
 
 
+// existing divergence (e.g. from combustion) plus div(U)
+inline float div_at(image3d_t U, image3d_t Dvg, int3 pos) {
+    float d0 = ix(Dvg, pos).x;
+    float d = -0.5f * h *
+         ((ix(U, pos + dx).x - ix(U, pos - dx).x)
+        + (ix(U, pos + dy).y - ix(U, pos - dy).y)
+        + (ix(U, pos + dz).z - ix(U, pos - dz).z));
+    return d0 + d;
+}
+
 void __kernel divergence(
     __read_only image3d_t U,
     __read_only image3d_t Dvg,
     __write_only image3d_t Dvg_out,
-    __write_only image3d_t P)
+    __write_only image3d_t P,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
 
-    float d0 = ix(Dvg, pos).x;
-    float d = -0.5f * h *
-         ((ix(U, pos + dx).x - ix(U, pos - dx).x)
-        + (ix(U, pos + dy).y - ix(U, pos - dy).y)
-        + (ix(U, pos + dz).z - ix(U, pos - dz).z));
-    wx(Dvg_out, pos, d0 + d);
+    wx(Dvg_out, pos, div_at(U, Dvg, pos));
 
     // avoid a call to enqueueFillImage by zeroing pressure field here
     wx(P, pos, 0);
@@ -253,9 +426,11 @@ void __kernel divergence(
 void __kernel jacobi(
     __read_only image3d_t P,        // pressure
     __read_only image3d_t Dvg,      // divergence
-    __write_only image3d_t P_out)
+    __write_only image3d_t P_out,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(P))) return;
     float f = ((ix(P, pos + dx).x + ix(P, pos - dx).x
               + ix(P, pos + dy).x + ix(P, pos - dy).x
               + ix(P, pos + dz).x + ix(P, pos - dz).x) + ix(Dvg, pos).x) / 6.0f;
@@ -263,12 +438,165 @@ void __kernel jacobi(
 }
 
 
+// sum of the 6 face neighbors, for the 7-point Laplacian
+inline float nsum(image3d_t P, int3 c) {
+    return ix(P, c + dx).x + ix(P, c - dx).x
+         + ix(P, c + dy).x + ix(P, c - dy).x
+         + ix(P, c + dz).x + ix(P, c - dz).x;
+}
+
+
+// multigrid: solves 6P - nsum(P) = F at any level of the hierarchy.
+// coarse levels are pre-scaled by restrict_residual so the operator is the
+// same everywhere.
+
+void __kernel smooth(
+    const float omega,              // Jacobi weight
+    __read_only image3d_t P,
+    __read_only image3d_t F,
+    __write_only image3d_t P_out,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, image_dims(P))) return;
+    float p = ix(P, pos).x;
+    float f = (nsum(P, pos) + ix(F, pos).x) / 6.0f;
+    wx(P_out, pos, mix(p, f, omega));
+}
+
+
+void __kernel residual(
+    __read_only image3d_t P,
+    __read_only image3d_t F,
+    __write_only image3d_t R,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, image_dims(P))) return;
+    float r = ix(F, pos).x - (6.0f * ix(P, pos).x - nsum(P, pos));
+    wx(R, pos, r);
+}
+
+
+void __kernel restrict_residual(
+    __read_only image3d_t R,        // fine residual
+    __write_only image3d_t F,       // coarse right-hand side
+    __write_only image3d_t P,       // coarse correction
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    int3 c = pos * 2;
+    if (outside(c, image_dims(R))) return;
+
+    float s = 0;
+    for (int k = 0; k < 2; k++)
+        for (int j = 0; j < 2; j++)
+            for (int i = 0; i < 2; i++)
+                s += ix(R, c + (int3)(i, j, k)).x;
+
+    // average of the 8 children, times (2h/h)^2 = 4 for the coarser spacing;
+    // past an odd side the clamped reads repeat the last fine layer
+    wx(F, pos, 0.5f * s);
+
+    // initial guess for the correction
+    wx(P, pos, 0);
+}
+
+
+void __kernel prolong(
+    __read_only image3d_t P,        // fine estimate
+    __read_only image3d_t E,        // coarse correction
+    __write_only image3d_t P_out,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, image_dims(P))) return;
+
+    // trilinear interpolation between cell centers comes free from the sampler
+    float3 cpos = (convert_float3(pos) + 0.5f) * 0.5f;
+    float e = read_imagef(E, samp_f, to4f(cpos)).x;
+    wx(P_out, pos, ix(P, pos).x + e);
+}
+
+
+// per-workgroup sums of (|r|^2, |F|^2), for the convergence test
+void __kernel residual_norm(
+    __read_only image3d_t P,
+    __read_only image3d_t F,
+    __global float2 *partial,
+    __global const int4 *bricks)
+{
+    __local float2 scratch[256];
+
+    int3 pos = grid_pos(bricks);
+    int lid = (get_local_id(2) * get_local_size(1) + get_local_id(1))
+            * get_local_size(0) + get_local_id(0);
+    int lsize = get_local_size(0) * get_local_size(1) * get_local_size(2);
+
+    float f = ix(F, pos).x;
+    float r = f - (6.0f * ix(P, pos).x - nsum(P, pos));
+    // (past the grid, work-items still have to reach the barriers)
+    scratch[lid] = outside(pos, image_dims(F)) ? (float2)(0)
+                                               : (float2)(r*r, f*f);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // workgroup sizes are always powers of 2
+    for (int s = lsize / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            scratch[lid] += scratch[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        int gid = (get_group_id(2) * get_num_groups(1) + get_group_id(1))
+                * get_num_groups(0) + get_group_id(0);
+        partial[gid] = scratch[0];
+    }
+}
+
+
+// per-workgroup max of |u|^2, for the adaptive time step
+void __kernel max_speed(
+    __read_only image3d_t U,
+    __global float *partial,
+    __global const int4 *bricks)
+{
+    __local float scratch[256];
+
+    int3 pos = grid_pos(bricks);
+    int lid = (get_local_id(2) * get_local_size(1) + get_local_id(1))
+            * get_local_size(0) + get_local_id(0);
+    int lsize = get_local_size(0) * get_local_size(1) * get_local_size(2);
+
+    // (reading clamps past the grid, which doesn't change the max)
+    float3 u = ix(U, pos).xyz;
+    scratch[lid] = dot(u, u);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = lsize / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            scratch[lid] = max(scratch[lid], scratch[lid + s]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        int gid = (get_group_id(2) * get_num_groups(1) + get_group_id(1))
+                * get_num_groups(0) + get_group_id(0);
+        partial[gid] = scratch[0];
+    }
+}
+
+
 void __kernel project(
     __read_only image3d_t U,        // velocity
     __read_only image3d_t P,        // pressure
-    __write_only image3d_t U_out)
+    __write_only image3d_t U_out,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
 
     float3 gradP = {
         ix(P, pos + dx).x - ix(P, pos - dx).x,
@@ -287,9 +615,11 @@ void __kernel set_bounds(
     __read_only image3d_t U,
     __read_only image3d_t T,
     __write_only image3d_t U_out,
-    __write_only image3d_t T_out)
+    __write_only image3d_t T_out,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
 
     float4 u = ix(U, pos);
     float4 t = ix(T, pos);
@@ -305,18 +635,163 @@ void __kernel set_bounds(
 }
 
 
+// fused pipeline: curl_bounded + step_fused replace set_bounds, curl,
+// add_forces and reaction; divergence_jacobi replaces divergence and the
+// first Jacobi iteration
+
+// velocity with boundary cells zeroed, as set_bounds would leave it
+inline float4 ixb(image3d_t U, image3d_t B, int3 c) {
+    return read_imageui(B, samp_i, to4i(c)).x ? (float4)(0) : ix(U, c);
+}
+
+void __kernel curl_bounded(
+    __read_only image3d_t B,
+    __read_only image3d_t U,
+    __write_only image3d_t Curl,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
+
+    float4 x1 = ixb(U, B, pos + dx);
+    float4 x2 = ixb(U, B, pos - dx);
+    float4 y1 = ixb(U, B, pos + dy);
+    float4 y2 = ixb(U, B, pos - dy);
+    float4 z1 = ixb(U, B, pos + dz);
+    float4 z2 = ixb(U, B, pos - dz);
+
+    wx(Curl, pos, curl_of(x1, x2, y1, y2, z1, z2));
+}
+
+
+void __kernel step_fused(
+    const float dt,
+    __read_only image3d_t B,
+    __read_only image3d_t U,
+    __read_only image3d_t T,
+    __read_only image3d_t Curl,
+    __write_only image3d_t U_out,
+    __write_only image3d_t T_out,
+    __write_only image3d_t Dvg,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
+
+    float4 u = ix(U, pos);
+    float4 t = ix(T, pos);
+    if (read_imageui(B, to4i(pos)).x) {
+        u = 0;
+        t = 0;
+    }
+
+    float dvg;
+    wx(U_out, pos, apply_forces(dt, u, t, Curl, pos));
+    wx(T_out, pos, react(dt, t, &dvg));
+    wx(Dvg, pos, (float4)(dvg, 0, 0, 0));
+}
+
+
+void __kernel divergence_jacobi(
+    __read_only image3d_t U,
+    __read_only image3d_t Dvg,
+    __write_only image3d_t Dvg_out,
+    __write_only image3d_t P,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(U))) return;
+
+    // one Jacobi iteration starting from P = 0
+    float d = div_at(U, Dvg, pos);
+    wx(Dvg_out, pos, d);
+    wx(P, pos, d / 6.0f);
+}
+
+
+// copy of any grid as float RGBA, for reading back on the host
+void __kernel to_float(
+    __read_only image3d_t F,
+    __write_only image3d_t F_out,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, image_dims(F))) return;
+    wx(F_out, pos, ix(F, pos));
+}
+
+
+// thresholds below which a cell counts as empty space
+__constant const float
+    eVel        = 0.01f,    // velocity (m/s)
+    eTemp       = 1.0f,     // deviation from ambient (K)
+    eSmoke      = 1e-4f,    // smoke/soot
+    eFuel       = 1e-6f;    // fuel
+
+// heat, smoke or fuel in a (temp, smoke, fuel) texel
+inline bool thermo_active(float4 f) {
+    return fabs(f.x - tAmb) > eTemp || f.y > eSmoke || f.z > eFuel;
+}
+
+// one flag per brick (= workgroup): does it hold anything worth simulating?
+void __kernel brick_activity(
+    __read_only image3d_t U,
+    __read_only image3d_t T,
+    __read_only image3d_t B,
+    __global uchar *mask,
+    __global const int4 *bricks)
+{
+    __local int active;
+
+    int3 pos = grid_pos(bricks);
+    if (get_local_id(0) == 0 && get_local_id(1) == 0 && get_local_id(2) == 0)
+        active = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    float3 u = ix(U, pos).xyz;
+    float4 f = ix(T, pos);
+    if (read_imageui(B, samp_i, to4i(pos)).x == 0
+     && (dot(u, u) > eVel*eVel || thermo_active(f)))
+    {
+        atomic_or(&active, 1);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (get_local_id(0) == 0 && get_local_id(1) == 0 && get_local_id(2) == 0) {
+        int id = (get_group_id(2) * get_num_groups(1) + get_group_id(1))
+               * get_num_groups(0) + get_group_id(0);
+        mask[id] = active;
+    }
+}
+
+
+// reset bricks to the canonical empty state: at rest, ambient temperature
+void __kernel clear_bricks(
+    uint thermo,                    // clearing a (temp, smoke, fuel) field
+    __read_only image3d_t B,
+    __write_only image3d_t F,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(B))) return;
+    float t = thermo && read_imageui(B, samp_i, to4i(pos)).x == 0 ? tAmb : 0;
+    wx(F, pos, (float4)(t, 0, 0, 0));
+}
+
+
 void __kernel add_explosion(
     const float3 loc,
     const float size,
     __read_only image3d_t T,
-    __write_only image3d_t T_out)
+    __write_only image3d_t T_out,
+    __global const int4 *bricks)
 {
-    int3 pos = {get_global_id(0), get_global_id(1), get_global_id(2)};
-    int id = (get_image_depth(T) * pos.z + pos.y) * get_image_height(T) + pos.x;
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(T))) return;
     float4 f = ix(T, pos);
 
-    // explosion positions are normalized coords
-    float3 fpos = convert_float3(pos) / get_image_width(T);
+    // explosion positions are world coords
+    float3 fpos = convert_float3(pos) * grid_voxel(T);
     float d = distance(loc, fpos);
     if (d < size) {
         f.xyz = (float3)(3000, 0, 1.25f);
@@ -326,4 +801,91 @@ void __kernel add_explosion(
 }
 
 
+
+// one flag per brick: does it hold anything worth exporting?
+void __kernel export_mask(
+    __read_only image3d_t T,
+    __read_only image3d_t B,
+    __global uchar *mask,
+    __global const int4 *bricks)
+{
+    __local int active;
+
+    int3 pos = grid_pos(bricks);
+    if (get_local_id(0) == 0 && get_local_id(1) == 0 && get_local_id(2) == 0)
+        active = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (read_imageui(B, samp_i, to4i(pos)).x == 0 && thermo_active(ix(T, pos)))
+        atomic_or(&active, 1);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (get_local_id(0) == 0 && get_local_id(1) == 0 && get_local_id(2) == 0) {
+        int id = (get_group_id(2) * get_num_groups(1) + get_group_id(1))
+               * get_num_groups(0) + get_group_id(0);
+        mask[id] = active;
+    }
+}
+
+
+// index of this work-item's texel in a packed run of bricks, when its
+// workgroup covers the brick'th one
+inline size_t brick_texel(size_t brick) {
+    return ((brick * get_local_size(2) + get_local_id(2))
+          * get_local_size(1) + get_local_id(1))
+          * get_local_size(0) + get_local_id(0);
+}
+
+
+// pack the chosen T channels of each brick export_mask flagged into out,
+// in brick order (x fastest) with the others' slots left alone, texels x
+// fastest; a dense launch, so it doesn't wait for the host to read the mask
+void __kernel export_gather(
+    uint channels,                  // bit 0 temp, 1 smoke, 2 fuel
+    __read_only image3d_t T,
+    __global const uchar *mask,
+    __global float *out,
+    __global const int4 *bricks)
+{
+    size_t id = (get_group_id(2) * get_num_groups(1) + get_group_id(1))
+              * get_num_groups(0) + get_group_id(0);
+    if (!mask[id])
+        return;
+
+    int3 pos = grid_pos(bricks);
+    size_t texel = brick_texel(id);
+    uint nch = popcount(channels);
+
+    float4 f = ix(T, pos);
+    float v[3] = {f.x, f.y, f.z};
+    uint k = 0;
+    for (int c = 0; c < 3; c++) {
+        if (channels & (1 << c))
+            out[texel * nch + k++] = v[c];
+    }
+}
+
+
+// inverse of export_gather; channels that weren't exported get their
+// empty value
+void __kernel import_scatter(
+    uint channels,
+    __global const float *in,
+    __write_only image3d_t T,
+    __global const int4 *bricks)
+{
+    int3 pos = grid_pos(bricks);
+    if (outside(pos, grid_dims(T))) return;
+    size_t texel = brick_texel(get_group_id(0));
+    uint nch = popcount(channels);
+
+    float v[3] = {tAmb, 0, 0};
+    uint k = 0;
+    for (int c = 0; c < 3; c++) {
+        if (channels & (1 << c))
+            v[c] = in[texel * nch + k++];
+    }
+    wx(T, pos, (float4)(v[0], v[1], v[2], 0));
+}
+
 #include "render.cl"
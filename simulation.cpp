@@ -1,16 +1,72 @@
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <climits>
+#include <iomanip>
+#include <set>
+#include <sstream>
 
 #include "simulation.h"
+#include "objects.h"
+#include "checkpoint.h"
 #include "clerror.h"
 #include "cie_xyz.h"
 
-Simulation::Simulation(Scene *sc, bool prof) :
-    scene(sc), profiling(prof), dt(sc->params.dt), N(sc->params.grid_n), t(0.0)
+static const std::string kernelNames[] = { "advect", "curl", "addForces",
+    "reaction", "divergence", "jacobi", "smooth", "residual", "restrict",
+    "prolong", "project", "setBounds", "curlBounded", "stepFused",
+    "divergenceJacobi", "activity", "clearBricks", "maxSpeed", "occupancy",
+    "lightVolume",
+    "exportMask", "exportGather", "importScatter", "render"};
+
+// bytes read + written per work-item, counting each image texel once
+// (RGBA float = 16, R float = 4, B = 1); neighbor reads are assumed to hit
+// in cache, and half storage isn't accounted for
+static const double kernelBytes[] = {
+    64,     // advect: U, T -> U, T
+    32,     // curl: U -> Curl
+    64,     // addForces: U, T, Curl -> U
+    36,     // reaction: T -> T, Dvg
+    28,     // divergence: U, Dvg -> Dvg, P
+    12,     // jacobi: P, Dvg -> P
+    12,     // smooth: P, F -> P
+    12,     // residual: P, F -> R
+    40,     // restrict: 8 fine R -> F, P
+    8.5,    // prolong: P, coarse P -> P
+    36,     // project: U, P -> U
+    65,     // setBounds: B, U, T -> U, T
+    33,     // curlBounded: B, U -> Curl
+    85,     // stepFused: B, U, T, Curl -> U, T, Dvg
+    28,     // divergenceJacobi: U, Dvg -> Dvg, P
+    33,     // activity: U, T, B -> (per-brick flag)
+    17,     // clearBricks: B -> one grid
+    16,     // maxSpeed: U -> (per-workgroup max)
+    0,      // occupancy
+    0,      // lightVolume
+    0,      // exportMask
+    0,      // exportGather
+    0,      // importScatter
+    0,      // render
+};
+
+Simulation::Simulation(Scene *sc, Profiler *prof, ClDevicePtr device,
+    bool isReference, const Slab *slab) :
+    scene(sc), prof(prof), slab(slab), frameDt(sc->params.dt),
+    cfl(slab ? slabCfl(sc->params.cfl) : sc->params.cfl), dt(sc->params.dt),
+    NX(sc->params.grid_x), NY(sc->params.grid_y),
+    NZ(slab ? slab->localNz() : sc->params.grid_z),
+    halfFields(isReference ? 0 : sc->params.half), t(0.0), exploded(false),
+    gridReady(false),
+    dev(device), gridBytes(0), bricks(NULL), nbricks(0), brickSteps(0.0),
+    previewScale(0), lastCells(0), traffic(0.0), launches(0), steps(0),
+    frames(0), maxSteps(0)
 {
     try {
+        // the starting state waits for first use (see ensureGrid)
         initOpenCL();
-        initGrid();
+        initMultigrid();
+        initSparse();
+        initExport();
         queue.finish();
         initRenderer();
     } catch (cl::Error err) {
@@ -18,72 +74,311 @@ Simulation::Simulation(Scene *sc, bool prof) :
         exit(1);
     }
 
-    initProfiling();
+    if (isReference) {
+        return;
+    }
+    if (slab && slab->count > 1) {
+        std::cout << "Slab " << slab->index << ": layers " << slab->z0 << "-"
+            << slab->z0 + slab->nz - 1 << ", ";
+    }
+    std::cout << "Grid storage: " << std::setprecision(1)
+        << gridBytes / (1024.0 * 1024.0) << " MB\n";
+    if (halfFields && scene->params.halfcheck > 0) {
+        std::cout << "Float reference run for halfcheck:\n";
+        reference.reset(new Simulation(sc, NULL, dev, true));
+    }
+    if (scene->params.exports && scene->params.exportcheck > 0
+     && scene->params.slabs <= 1) {
+        std::cout << "Replay run for exportcheck:\n";
+        replay.reset(new Simulation(sc, NULL, dev, true));
+    }
+
+    if (prof) {
+        prof->calibrate(queue);
+    }
 }
 
 void Simulation::advance() {
-    static bool exploded = false;
+    ensureGrid();
     if (t > 0.2 && !exploded) {
-        addExplosion();
+        auto spheres = slab ? slab->link->spheres : explosionSpheres();
+        addExplosion(spheres);
         exploded = true;
+        if (reference) {
+            reference->addExplosion(spheres);
+            reference->exploded = true;
+        }
     }
 
-    setBounds();
-    addForces();
-    reaction();
-    project();
-    advect();
-    project();
+    // one frame: a single step, or CFL-limited steps that add up to it
+    const float end = t + frameDt;
+    unsigned n = 0;
+    do {
+        if (cfl > 0) {
+            dt = cflStep(end - t);
+        }
+        update();
+        if (cfl > 0) {
+            // for the next step's dt, read back while the host moves on
+            requestMaxSpeed();
+        }
+        if (reference) {
+            reference->dt = dt;
+            reference->update();
+            if (steps % scene->params.halfcheck == 0) {
+                checkHalf();
+            }
+        }
+        n++;
+    } while (cfl > 0 && end - t > 1e-3f * frameDt);
+    t = end;
+    frames++;
+    maxSteps = std::max(maxSteps, n);
+    if (replay && frames % scene->params.exportcheck == 0) {
+        checkExport();
+    }
+
+    // pick up whatever finished, without waiting
+    if (prof) {
+        prof->resolve();
+    }
+}
+
+void Simulation::update() {
+    if (scene->params.sparse) {
+        updateBricks();
+        bricks = &brickList;
+        nbricks = activeHost.size();
+    }
+
+    if (bricks && nbricks == 0) {
+        // nothing but empty space at rest: nothing to do
+    } else if (scene->params.fused == FUSED_CHECK) {
+        checkFused();
+    } else {
+        step(scene->params.fused == FUSED_ON);
+    }
+    bricks = NULL;
 
     t += dt;
+    steps++;
+}
+
+void Simulation::step(bool fused) {
+    if (fused) {
+        stepFused();
+    } else {
+        setBounds();
+        addForces();
+        reaction();
+    }
+    project(fused);
+    advect();
+    project(fused);
 }
 
 float Simulation::getT() {
     return t;
 }
 
-void Simulation::render(HostImage &img) {
-    int w = scene->cam.size.x,
-        h = scene->cam.size.y;
+cl::Image3D Simulation::prepareRender() {
+    ensureGrid();
+
+    // when overlapping, render a snapshot of T on the second queue so the
+    // simulation queue can move on to the next step right away
+    cl::Image3D Tr = T;
+    std::vector<cl::Event> waitSnap;
+    if (scene->params.overlap) {
+        cl::size_t<3> origin;
+        cl::size_t<3> region = gridRegion();
+
+        // previous render must be done reading the snapshot
+        std::vector<cl::Event> waitRender;
+        if (renderDone() != NULL) {
+            waitRender.push_back(renderDone);
+        }
+
+        cl::Event snapped;
+        queue.enqueueCopyImage(T, T_snap, origin, origin, region,
+            &waitRender, &snapped);
+        queue.flush();
+        waitSnap.push_back(snapped);
+        Tr = T_snap;
+    }
+
+    // occupancy grid and bounding box of this frame's smoke, so rays can
+    // skip empty space
+    static const cl_int bboxEmpty[6] = {INT_MAX, INT_MAX, INT_MAX, -1, -1, -1};
+    renderQueue.enqueueWriteBuffer(occBox, false, 0, sizeof(bboxEmpty),
+        bboxEmpty, waitSnap.empty() ? NULL : &waitSnap);
+    kOccupancy.setArg(0, Tr);
+    kOccupancy.setArg(1, B);
+    kOccupancy.setArg(2, Occ);
+    kOccupancy.setArg(3, occBox);
+    renderQueue.enqueueNDRangeKernel(kOccupancy, cl::NullRange,
+        gridSize(3), cl::NullRange, NULL, &event);
+    profile(OCCUPANCY, Profiler::LANE_RENDER);
+
+    if (scene->params.lightvol) {
+        kLightVolume.setArg(0, scene->light);
+        kLightVolume.setArg(1, Tr);
+        kLightVolume.setArg(2, Occ);
+        kLightVolume.setArg(3, occBox);
+        kLightVolume.setArg(4, bbspec);
+        kLightVolume.setArg(5, Lvol);
+        renderQueue.enqueueNDRangeKernel(kLightVolume, cl::NullRange,
+            Tuner::padded(gridSize(), localRange(0)), localRange(0), NULL,
+            &event);
+        profile(LIGHT_VOLUME, Profiler::LANE_RENDER);
+    }
+    return Tr;
+}
+
+void Simulation::render(const std::vector<HostImage *> &imgs) {
+    cl::Image3D Tr = prepareRender();
 
-    // render to target image
-    kRender.setArg(0, scene->cam);
+    // render each view to its target image; everything above is shared, so
+    // an extra view only costs its ray march
     kRender.setArg(1, scene->light);
-    kRender.setArg(2, T);
+    kRender.setArg(2, Tr);
     kRender.setArg(3, B);
     kRender.setArg(4, BN);
     kRender.setArg(5, bbspec);
-    kRender.setArg(6, target);
-    queue.enqueueNDRangeKernel(kRender, cl::NullRange, cl::NDRange(w, h),
-            cl::NDRange(16, 16), NULL, &event);
-    profile(RENDER);
+    kRender.setArg(6, Occ);
+    kRender.setArg(7, occBox);
+    kRender.setArg(8, scene->params.lightvol ? Lvol : Tr);
+    kRender.setArg(9, (cl_uint) scene->params.lightvol);
+    for (size_t v = 0; v < imgs.size(); v++) {
+        HostImage &img = *imgs[v];
+        kRender.setArg(0, scene->cams[v]);
+        kRender.setArg(10, targets[v]);
+        cl::NDRange size(img.w, img.h), local(16, 16);
+        if (scene->params.autotune) {
+            local = dev->tuner->local(renderQueue, kRender, size,
+                {{16, 16}, {8, 8}, {32, 8}, {8, 32}, {32, 4}, {64, 4}, {16, 8},
+                 {16, 4}}, true);
+        }
+        renderQueue.enqueueNDRangeKernel(kRender, cl::NullRange,
+            Tuner::padded(size, local), local, NULL, &event);
+        renderDone = event;
+        profile(RENDER, Profiler::LANE_RENDER);
 
-    // read rendered image into host memory
-    cl::size_t<3> origin;
-    cl::size_t<3> region;
-    region[0] = w;
-    region[1] = h;
-    region[2] = 1;
-    queue.enqueueReadImage(target, true, origin, region, 0, 0, img.data);
+        // read rendered image into host memory
+        cl::size_t<3> origin;
+        cl::size_t<3> region;
+        region[0] = img.w;
+        region[1] = img.h;
+        region[2] = 1;
+        // non-blocking: img.ready signals completion
+        renderQueue.enqueueReadImage(targets[v], false, origin, region, 0, 0,
+            img.data, NULL, &img.ready);
+        if (prof) {
+            prof->record("readback", img.ready, Profiler::LANE_RENDER);
+        }
+    }
+    renderQueue.flush();
 }
 
-void Simulation::initOpenCL() {
-    cl::Platform platform = cl::Platform::getDefault();
-    cl::Device device = cl::Device::getDefault();
-    std::cout << "OpenCL platform: " << platform.getInfo<CL_PLATFORM_NAME>() << "\n";
-    std::cout << "OpenCL device: " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+void Simulation::preview(const std::vector<HostImage *> &imgs, int scale,
+    int pass)
+{
+    // a build with 1/scale the ray samples, on first use or a new scale
+    if (scale != previewScale) {
+        cl::Program prog = dev->program(buildOptions(scale));
+        kPreview = cl::Kernel(prog, "render_preview");
+        kResolve = cl::Kernel(prog, "preview_resolve");
+        previewScale = scale;
+        previewAccum.clear();
+        pass = 0;
+    }
+    if (previewAccum.empty()) {
+        pass = 0;
+        for (auto img : imgs) {
+            size_t w = (img->w + scale - 1) / scale,
+                   h = (img->h + scale - 1) / scale;
+            previewAccum.push_back(cl::Buffer(context, CL_MEM_READ_WRITE,
+                sizeof(cl_float4) * w * h));
+        }
+    }
 
-    context = cl::Context(device);
-    queue = cl::CommandQueue(context, device, profiling ? CL_QUEUE_PROFILING_ENABLE : 0);
+    // later passes reuse the first one's occupancy and snapshot
+    if (pass == 0) {
+        previewT = prepareRender();
+    }
 
-    // read & compile simulation program
-    program = cl::Program(context, slurpFile("simulate.cl"));
-    try {
-        program.build();
-    } catch (cl::Error err) {
-        std::cerr << "\nOpenCL compilation log:\n" <<
-            program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-        throw err;
+    kPreview.setArg(1, scene->light);
+    kPreview.setArg(2, previewT);
+    kPreview.setArg(3, B);
+    kPreview.setArg(4, BN);
+    kPreview.setArg(5, bbspec);
+    kPreview.setArg(6, Occ);
+    kPreview.setArg(7, occBox);
+    kPreview.setArg(8, scene->params.lightvol ? Lvol : previewT);
+    kPreview.setArg(9, (cl_uint) scene->params.lightvol);
+    kPreview.setArg(10, (cl_uint) pass);
+    for (size_t v = 0; v < imgs.size(); v++) {
+        HostImage &img = *imgs[v];
+        Camera cam = scene->cams[v];
+        cam.size.s[0] = (img.w + scale - 1) / scale;
+        cam.size.s[1] = (img.h + scale - 1) / scale;
+        kPreview.setArg(0, cam);
+        kPreview.setArg(11, previewAccum[v]);
+        cl::NDRange local(8, 8);
+        renderQueue.enqueueNDRangeKernel(kPreview, cl::NullRange,
+            Tuner::padded(cl::NDRange(cam.size.s[0], cam.size.s[1]), local),
+            local);
+
+        // upsampled into the full-size target
+        cl_uint2 outSize = {(cl_uint) img.w, (cl_uint) img.h};
+        kResolve.setArg(0, cam.size);
+        kResolve.setArg(1, previewAccum[v]);
+        kResolve.setArg(2, outSize);
+        kResolve.setArg(3, targets[v]);
+        local = cl::NDRange(16, 16);
+        renderQueue.enqueueNDRangeKernel(kResolve, cl::NullRange,
+            Tuner::padded(cl::NDRange(img.w, img.h), local), local);
+
+        cl::size_t<3> origin;
+        cl::size_t<3> region;
+        region[0] = img.w;
+        region[1] = img.h;
+        region[2] = 1;
+        renderQueue.enqueueReadImage(targets[v], false, origin, region, 0, 0,
+            img.data, NULL, &img.ready);
+    }
+    renderQueue.flush();
+}
+
+// -D options specializing simulate.cl for this scene; simulations with the
+// same ones share a build. Previews divide the ray samples by their scale.
+std::string Simulation::buildOptions(int sampleDiv) const {
+    const SimParams &p = scene->params;
+    std::ostringstream opts;
+    opts << "-DGRID_NX=" << NX << " -DGRID_NY=" << NY << " -DGRID_NZ=" << NZ
+        << " -DNSAMP=" << std::max(1, p.samples / sampleDiv)
+        << " -DNLSAMP=" << std::max(1, p.lightsamples / sampleDiv)
+        << " -DGRID_N=" << std::max(p.grid_x, std::max(p.grid_y, p.grid_z))
+        << " -DWALLS=" << wallMask()
+        << " -DNOBJS=" << scene->objects.size() - 1     // minus the null one
+        << " -DOBJ_BIN=" << OBJ_BIN
+        << " -DCELL_H=" << std::fixed << std::setprecision(6) << CELL_SIZE
+        << "f";
+    return opts.str();
+}
+
+void Simulation::initOpenCL() {
+    if (!dev) {
+        dev = openDevice();
+    }
+    cl::Device device = dev->device;
+    context = dev->context;
+    program = dev->program(buildOptions());
+    queue = cl::CommandQueue(context, device, prof ? CL_QUEUE_PROFILING_ENABLE : 0);
+    if (scene->params.overlap) {
+        renderQueue = cl::CommandQueue(context, device,
+            prof ? CL_QUEUE_PROFILING_ENABLE : 0);
+    } else {
+        renderQueue = queue;
     }
 
     // load kernels from the program
@@ -95,44 +390,170 @@ void Simulation::initOpenCL() {
     kJacobi = cl::Kernel(program, "jacobi");
     kProject = cl::Kernel(program, "project");
     kSetBounds = cl::Kernel(program, "set_bounds");
+    kSmooth = cl::Kernel(program, "smooth");
+    kResidual = cl::Kernel(program, "residual");
+    kRestrict = cl::Kernel(program, "restrict_residual");
+    kProlong = cl::Kernel(program, "prolong");
+    kResidualNorm = cl::Kernel(program, "residual_norm");
+    kCurlBounded = cl::Kernel(program, "curl_bounded");
+    kStepFused = cl::Kernel(program, "step_fused");
+    kDivergenceJacobi = cl::Kernel(program, "divergence_jacobi");
+    kActivity = cl::Kernel(program, "brick_activity");
+    kClear = cl::Kernel(program, "clear_bricks");
     // kRender = cl::Kernel(program, "render_slice");
     kRender = cl::Kernel(program, "render");
+    kOccupancy = cl::Kernel(program, "build_occupancy");
+    kLightVolume = cl::Kernel(program, "light_volume");
+    kToFloat = cl::Kernel(program, "to_float");
+    kMaxSpeed = cl::Kernel(program, "max_speed");
+    kExportMask = cl::Kernel(program, "export_mask");
+    kExportGather = cl::Kernel(program, "export_gather");
+    kImportScatter = cl::Kernel(program, "import_scatter");
 
     // create buffers
-    U = makeGrid3D(3);
-    U_tmp = makeGrid3D(3);
-    T = makeGrid3D(3);
-    T_tmp = makeGrid3D(3);
+    U = makeGrid3D(3, gridType(FIELD_U, 3));
+    U_tmp = makeGrid3D(3, gridType(FIELD_U, 3));
+    T = makeGrid3D(3, gridType(FIELD_T, 3));
+    T_tmp = makeGrid3D(3, gridType(FIELD_T, 3));
     B = makeGrid3D(1, CL_UNSIGNED_INT8);
-    BN = makeGrid3D(3);
+    BN = makeGrid3D(3, gridType(FIELD_BN, 3));
 
-    P = makeGrid3D(1);
-    P_tmp = makeGrid3D(1);
-    Dvg = makeGrid3D(1);
-    Dvg_tmp = makeGrid3D(1);
-    Curl = makeGrid3D(3);
+    P = makeGrid3D(1, gridType(FIELD_P, 1));
+    P_tmp = makeGrid3D(1, gridType(FIELD_P, 1));
+    Dvg = makeGrid3D(1, gridType(FIELD_DVG, 1));
+    Dvg_tmp = makeGrid3D(1, gridType(FIELD_DVG, 1));
+    Curl = makeGrid3D(3, gridType(FIELD_CURL, 3));
+    if (scene->params.overlap) {
+        T_snap = makeGrid3D(3, gridType(FIELD_T, 3));
+    }
+    if (scene->params.fused == FUSED_CHECK) {
+        U_check = makeGrid3D(3, gridType(FIELD_U, 3));
+        T_check = makeGrid3D(3, gridType(FIELD_T, 3));
+    }
+
+    // empty-space skipping: one texel per 8^3 macro-cell
+    Occ = makeGrid3D(1, CL_FLOAT, 3);
+    occBox = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * 6);
+    if (scene->params.lightvol) {
+        Lvol = makeGrid3D(1);
+    }
+
+    // adaptive step: one partial max per fine-level workgroup
+    if (cfl > 0) {
+        cl::NDRange nb = brickCounts();
+        size_t ngroups = nb[0] * nb[1] * nb[2];
+        speedPartial = cl::Buffer(context, CL_MEM_WRITE_ONLY,
+            sizeof(cl_float) * ngroups);
+        speedHost.resize(ngroups);
+    }
 
-    // create render target
-    target = cl::Image2D(context, CL_MEM_WRITE_ONLY, cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
-        scene->cam.size.x, scene->cam.size.y);
+    // create render targets, one per view
+    for (auto &cam : scene->cams) {
+        targets.push_back(cl::Image2D(context, CL_MEM_WRITE_ONLY,
+            cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8), cam.size.x, cam.size.y));
+    }
+}
+
+// see init_grid
+unsigned Simulation::wallMask() const {
+    if (!scene->params.walls) {
+        return 0;
+    }
+    unsigned mask = 7;
+    if (slab && slab->lo()) {
+        mask &= ~2;
+    }
+    if (slab && slab->hi()) {
+        mask &= ~4;
+    }
+    return mask;
 }
 
 void Simulation::initGrid() {
-    cl_uint nobjs = scene->objects.size();
+    // objects are in the whole grid's coordinates; a slab starts further up
+    const std::vector<Object> &objects = scene->objects;
+    cl_int z0 = slab ? (cl_int) (slab->z0 - slab->lo()) : 0;
+    ObjectBins bins = binObjects(objects, NX, NY, NZ, z0);
+    cl_uint nobjs = objects.size();
     auto objs = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        sizeof(Object) * nobjs, (void *)scene->objects.data());
+        sizeof(Object) * nobjs, (void *)objects.data());
+    auto binBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        sizeof(cl_uint) * bins.index.size(), (void *)bins.index.data());
 
     auto kInitGrid = cl::Kernel(program, "init_grid");
-    kInitGrid.setArg(0, scene->params.walls);
-    kInitGrid.setArg(1, nobjs-1);
-    kInitGrid.setArg(2, objs);
-    kInitGrid.setArg(3, U);
-    kInitGrid.setArg(4, T);
-    kInitGrid.setArg(5, B);
+    kInitGrid.setArg(0, wallMask());
+    kInitGrid.setArg(1, z0);
+    kInitGrid.setArg(2, nobjs-1);
+    kInitGrid.setArg(3, objs);
+    kInitGrid.setArg(4, binBuf);
+    kInitGrid.setArg(5, U);
+    kInitGrid.setArg(6, T);
+    kInitGrid.setArg(7, B);
     enqueueGrid(kInitGrid);
+
+    // object normals, for rendering (slabs are rendered from a copy)
+    if (!slab) {
+        auto kNormals = cl::Kernel(program, "gen_normals");
+        kNormals.setArg(0, B);
+        kNormals.setArg(1, BN);
+        enqueueGrid(kNormals);
+    }
+}
+
+void Simulation::ensureGrid() {
+    if (gridReady) {
+        return;
+    }
+    gridReady = true;
+    initGrid();
+
+    // inactive bricks are never written, so everything has to start out
+    // in the canonical empty state
+    if (scene->params.sparse) {
+        clearBricks(0);
+    }
+    if (reference) {
+        reference->ensureGrid();
+    }
+}
+
+void Simulation::initMultigrid() {
+    mgSolves = mgCycles = 0;
+    mgResidual = 0.0f;
+    normLast = 0;
+    if (scene->params.solver != SOLVER_MULTIGRID) {
+        return;
+    }
+
+    // halve the grid (odd sides rounding up, see gridSize) until it gets
+    // too small to be worth another level
+    levels.resize(1);
+    const int type = gridType(FIELD_P, 1);
+    levels[0].R = makeGrid3D(1, type);
+    const unsigned nmin = std::min(NX, std::min(NY, NZ));
+    for (int l = 1; ((nmin - 1) >> l) + 1 >= 4; l++) {
+        Level L;
+        L.P = makeGrid3D(1, type, l);
+        L.P_tmp = makeGrid3D(1, type, l);
+        L.F = makeGrid3D(1, type, l);
+        L.R = makeGrid3D(1, type, l);
+        levels.push_back(L);
+    }
+
+    // one partial (|r|^2, |F|^2) sum per fine-level workgroup
+    cl::NDRange nb = brickCounts();
+    size_t ngroups = nb[0] * nb[1] * nb[2];
+    normPartial = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float2) * ngroups);
+    normHost[0].resize(ngroups);
+    normHost[1].resize(ngroups);
 }
 
 void Simulation::initRenderer() {
+    // slabs are rendered from a gathered copy
+    if (slab) {
+        return;
+    }
+
     // pre-compute blackbody spectra
 
     auto cieVals = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
@@ -147,20 +568,6 @@ void Simulation::initRenderer() {
     kBlackbody.setArg(1, bbspec);
     queue.enqueueNDRangeKernel(kBlackbody, cl::NullRange, cl::NDRange(nTemps),
             cl::NDRange(64), NULL, &event);
-
-    // pre-compute object normals
-
-    auto kNormals = cl::Kernel(program, "gen_normals");
-    kNormals.setArg(0, B);
-    kNormals.setArg(1, BN);
-    enqueueGrid(kNormals);
-}
-
-void Simulation::initProfiling() {
-    for (int i = 0; i < _LAST; i++) {
-        kernelTimes[i] = 0.0f;
-        kernelCalls[i] = 0;
-    }
 }
 
 void Simulation::advect() {
@@ -174,6 +581,7 @@ void Simulation::advect() {
 
     std::swap(U, U_tmp);
     std::swap(T, T_tmp);
+    halo({&U, &T});
 }
 
 void Simulation::addForces() {
@@ -182,6 +590,7 @@ void Simulation::addForces() {
     kCurl.setArg(1, Curl);
     enqueueGrid(kCurl);
     profile(CURL);
+    halo({&Curl});
 
     kAddForces.setArg(0, dt);
     kAddForces.setArg(1, U);
@@ -191,6 +600,7 @@ void Simulation::addForces() {
     enqueueGrid(kAddForces);
     profile(ADD_FORCES);
     std::swap(U, U_tmp);
+    halo({&U});
 }
 
 void Simulation::reaction() {
@@ -203,26 +613,39 @@ void Simulation::reaction() {
     std::swap(T, T_tmp);
 }
 
-void Simulation::project() {
+void Simulation::project(bool fused) {
+    const bool jacobi = scene->params.solver == SOLVER_JACOBI;
+
     // compute Dvg = div(U)
-    // (also zeroes out P)
-    kDivergence.setArg(0, U);
-    kDivergence.setArg(1, Dvg);
-    kDivergence.setArg(2, Dvg_tmp);
-    kDivergence.setArg(3, P);
-    enqueueGrid(kDivergence);
-    profile(DIVERGENCE);
+    // (also zeroes out P, or does the first Jacobi iteration when fused)
+    cl::Kernel &kDiv = (fused && jacobi) ? kDivergenceJacobi : kDivergence;
+    kDiv.setArg(0, U);
+    kDiv.setArg(1, Dvg);
+    kDiv.setArg(2, Dvg_tmp);
+    kDiv.setArg(3, P);
+    enqueueGrid(kDiv);
+    profile((fused && jacobi) ? DIVERGENCE_JACOBI : DIVERGENCE);
     std::swap(Dvg, Dvg_tmp);
 
     // solve laplace(P) = div(U) for P
-    const int niters = scene->params.niters;
-    for (int i = 0; i < niters; i++) {
-        kJacobi.setArg(0, P);
-        kJacobi.setArg(1, Dvg);
-        kJacobi.setArg(2, P_tmp);
-        enqueueGrid(kJacobi);
-        profile(JACOBI);
-        std::swap(P, P_tmp);
+    if (!jacobi) {
+        multigrid();
+    } else {
+        const int niters = scene->params.niters;
+        for (int i = fused ? 1 : 0; i < niters; i++) {
+            kJacobi.setArg(0, P);
+            kJacobi.setArg(1, Dvg);
+            kJacobi.setArg(2, P_tmp);
+            enqueueGrid(kJacobi);
+            profile(JACOBI);
+            std::swap(P, P_tmp);
+            // each iteration spoils one more ghost layer from the outside
+            // in, so the interior stays exact if they're refreshed every
+            // SLAB_HALO iterations
+            if ((i + 1) % SLAB_HALO == 0 || i == niters - 1) {
+                halo({&P});
+            }
+        }
     }
 
     // compute new U' = U - grad(P)
@@ -232,6 +655,485 @@ void Simulation::project() {
     enqueueGrid(kProject);
     profile(PROJECT);
     std::swap(U, U_tmp);
+    halo({&U});
+}
+
+void Simulation::multigrid() {
+    levels[0].P = P;
+    levels[0].P_tmp = P_tmp;
+    levels[0].F = Dvg;
+
+    // the last solve's final residual has long come back by now
+    if (normRead[normLast]() != NULL) {
+        mgResidual = residualNorm(normLast);
+    }
+
+    // V-cycles until the residual drops below tolerance; each cycle's
+    // residual comes back while the next one runs, so the queue never
+    // drains, and a solve may take one cycle more than it needs
+    const float tol = scene->params.tolerance;
+    const int maxcycles = scene->params.maxcycles;
+    int slot = 0;
+    for (int c = 0; c < maxcycles; c++) {
+        vcycle(0);
+        mgCycles++;
+        requestResidualNorm(slot);
+        slot ^= 1;
+        if (c > 0) {
+            mgResidual = residualNorm(slot);
+            if (mgResidual < tol) {
+                break;
+            }
+        }
+    }
+    normLast = slot ^ 1;
+    mgSolves++;
+
+    P = levels[0].P;
+    P_tmp = levels[0].P_tmp;
+}
+
+void Simulation::vcycle(int l) {
+    const int nPre = 2, nPost = 2, nCoarse = 16;
+    Level &L = levels[l];
+
+    // coarsest level: just smooth, it's tiny
+    if (l == (int) levels.size() - 1) {
+        smooth(l, nCoarse);
+        return;
+    }
+
+    smooth(l, nPre);
+
+    // R = F - A*P
+    kResidual.setArg(0, L.P);
+    kResidual.setArg(1, L.F);
+    kResidual.setArg(2, L.R);
+    enqueueGrid(kResidual, l);
+    profile(RESIDUAL);
+
+    // coarse F = restrict(R), coarse P = 0
+    Level &C = levels[l+1];
+    kRestrict.setArg(0, L.R);
+    kRestrict.setArg(1, C.F);
+    kRestrict.setArg(2, C.P);
+    enqueueGrid(kRestrict, l+1);
+    profile(RESTRICT);
+
+    vcycle(l+1);
+
+    // P += prolong(coarse P)
+    kProlong.setArg(0, L.P);
+    kProlong.setArg(1, C.P);
+    kProlong.setArg(2, L.P_tmp);
+    enqueueGrid(kProlong, l);
+    profile(PROLONG);
+    std::swap(L.P, L.P_tmp);
+
+    smooth(l, nPost);
+}
+
+void Simulation::smooth(int l, int iters) {
+    // optimal damping for the 7-point stencil
+    const float omega = 6.0f / 7.0f;
+
+    Level &L = levels[l];
+    for (int i = 0; i < iters; i++) {
+        kSmooth.setArg(0, omega);
+        kSmooth.setArg(1, L.P);
+        kSmooth.setArg(2, L.F);
+        kSmooth.setArg(3, L.P_tmp);
+        enqueueGrid(kSmooth, l);
+        profile(SMOOTH);
+        std::swap(L.P, L.P_tmp);
+    }
+}
+
+void Simulation::requestResidualNorm(int slot) {
+    kResidualNorm.setArg(0, levels[0].P);
+    kResidualNorm.setArg(1, levels[0].F);
+    kResidualNorm.setArg(2, normPartial);
+    enqueueGrid(kResidualNorm);
+    profile(RESIDUAL);
+
+    // a sparse launch only fills one partial per active brick; the queue
+    // is in order, so the next launch waits for this read
+    normCount[slot] = bricks ? nbricks : normHost[slot].size();
+    queue.enqueueReadBuffer(normPartial, false, 0,
+        sizeof(cl_float2) * normCount[slot], normHost[slot].data(), NULL,
+        &normRead[slot]);
+    queue.flush();
+}
+
+float Simulation::residualNorm(int slot) {
+    normRead[slot].wait();
+    normRead[slot] = cl::Event();
+
+    double rr = 0.0, ff = 0.0;
+    for (size_t i = 0; i < normCount[slot]; i++) {
+        rr += normHost[slot][i].s[0];
+        ff += normHost[slot][i].s[1];
+    }
+    return ff > 0.0 ? std::sqrt(rr / ff) : 0.0f;
+}
+
+void Simulation::requestMaxSpeed() {
+    kMaxSpeed.setArg(0, U);
+    kMaxSpeed.setArg(1, speedPartial);
+    enqueueGrid(kMaxSpeed);
+    profile(MAX_SPEED);
+
+    queue.enqueueReadBuffer(speedPartial, false, 0,
+        sizeof(cl_float) * speedHost.size(), speedHost.data(), NULL,
+        &speedRead);
+    queue.flush();
+}
+
+float Simulation::maxSpeed() {
+    if (speedRead() == NULL) {
+        requestMaxSpeed();
+    }
+    speedRead.wait();
+    speedRead = cl::Event();
+
+    float m = 0.0f;
+    for (float s : speedHost) {
+        m = std::max(m, s);
+    }
+    if (slab) {
+        // every slab has to take the same steps
+        m = slab->link->reduceMax(slab->index, m);
+    }
+    return std::sqrt(m);
+}
+
+float Simulation::cflStep(float remaining) {
+    // fewest equal steps over the rest of the frame that stay under the
+    // CFL target; the explosion is what pushes this up
+    float cells = maxSpeed() * remaining / CELL_SIZE;
+    int n = std::max((int) std::ceil(cells / cfl), 1);
+    // a slab's ghost layers bound its steps, however many that takes
+    if (!slab) {
+        n = std::min(n, scene->params.maxsubsteps);
+    }
+    return remaining / n;
+}
+
+void Simulation::halo(const std::vector<cl::Image3D *> &imgs) {
+    if (!slab) {
+        return;
+    }
+    SlabLink &link = *slab->link;
+    const int k = slab->index;
+    std::vector<size_t> offset = {0};
+    for (auto img : imgs) {
+        offset.push_back(offset.back() + (size_t) NX * NY * SLAB_HALO
+            * img->getImageInfo<CL_IMAGE_ELEMENT_SIZE>());
+    }
+    cl::size_t<3> origin;
+    cl::size_t<3> region = gridRegion();
+    region[2] = SLAB_HALO;
+
+    // hand over the interior layers next to each inner face, every image
+    // in one go...
+    link.down[k].resize(slab->lo() ? offset.back() : 0);
+    link.up[k].resize(slab->hi() ? offset.back() : 0);
+    for (size_t f = 0; f < imgs.size(); f++) {
+        if (slab->lo()) {
+            origin[2] = slab->lo();
+            queue.enqueueReadImage(*imgs[f], false, origin, region, 0, 0,
+                &link.down[k][offset[f]]);
+        }
+        if (slab->hi()) {
+            origin[2] = slab->lo() + slab->nz - SLAB_HALO;
+            queue.enqueueReadImage(*imgs[f], false, origin, region, 0, 0,
+                &link.up[k][offset[f]]);
+        }
+    }
+    queue.finish();
+    link.wait();
+
+    // ...and take the neighbours' as ghost layers
+    for (size_t f = 0; f < imgs.size(); f++) {
+        if (slab->lo()) {
+            origin[2] = 0;
+            queue.enqueueWriteImage(*imgs[f], false, origin, region, 0, 0,
+                &link.up[k-1][offset[f]]);
+        }
+        if (slab->hi()) {
+            origin[2] = slab->lo() + slab->nz;
+            queue.enqueueWriteImage(*imgs[f], false, origin, region, 0, 0,
+                &link.down[k+1][offset[f]], NULL, &event);
+            if (prof) {
+                prof->record("halo", event);
+            }
+        }
+    }
+    queue.finish();
+
+    // nobody refills the layers until everybody has them
+    link.wait();
+}
+
+void Simulation::initSparse() {
+    if (!scene->params.sparse) {
+        return;
+    }
+
+    // a brick is one fine-level workgroup
+    cl::NDRange counts = brickCounts();
+    size_t nb = counts[0] * counts[1] * counts[2];
+    brickMask = cl::Buffer(context, CL_MEM_WRITE_ONLY, nb);
+    brickList = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int4) * nb);
+    clearList = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int4) * nb);
+    mask.resize(nb);
+    active.assign(nb, 0);
+}
+
+void Simulation::initExport() {
+    unsigned nch = __builtin_popcount(scene->params.exports);
+    if (!nch || slab) {
+        return;
+    }
+
+    // whole bricks, so the partial ones at the far faces fit; read too, by
+    // an exportcheck replay
+    cl::NDRange local = localRange(0), counts = brickCounts();
+    size_t nb = counts[0] * counts[1] * counts[2];
+    exportMask = cl::Buffer(context, CL_MEM_WRITE_ONLY, nb);
+    exportList = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int4) * nb);
+    exportData = cl::Buffer(context, CL_MEM_READ_WRITE,
+        sizeof(cl_float) * nch * nb * local[0] * local[1] * local[2]);
+}
+
+void Simulation::exportVolume(VolumeFrame &vol) {
+    ensureGrid();
+    cl::NDRange local = localRange(0);
+    vol.nx = NX;
+    vol.ny = NY;
+    vol.nz = NZ;
+    vol.bx = local[0];
+    vol.by = local[1];
+    vol.bz = local[2];
+    vol.channels = scene->params.exports;
+    vol.t = t;
+    vol.bricks.clear();
+    vol.data.clear();
+
+    // the last export's bricks have to be out of exportData (and its mask
+    // out of exportMask) before this one overwrites them
+    std::vector<cl::Event> waitFetch;
+    if (exportDone() != NULL) {
+        waitFetch.push_back(exportDone);
+    }
+    cl::UserEvent done(context);
+    exportDone = done;
+
+    // dense launches at the brick size, so that workgroups are bricks
+    kExportMask.setArg(0, T);
+    kExportMask.setArg(1, B);
+    kExportMask.setArg(2, exportMask);
+    kExportMask.setArg(3, cl::Buffer());
+    const cl::NDRange global = Tuner::padded(gridSize(), local);
+    queue.enqueueNDRangeKernel(kExportMask, cl::NullRange, global, local,
+        waitFetch.empty() ? NULL : &waitFetch, &event);
+    profile(EXPORT_MASK);
+    std::vector<cl::Event> waitMask = {event};
+
+    kExportGather.setArg(0, (cl_uint) vol.channels);
+    kExportGather.setArg(1, T);
+    kExportGather.setArg(2, exportMask);
+    kExportGather.setArg(3, exportData);
+    kExportGather.setArg(4, cl::Buffer());
+    queue.enqueueNDRangeKernel(kExportGather, cl::NullRange, global, local,
+        NULL, &event);
+    profile(EXPORT_GATHER);
+    std::vector<cl::Event> waitGather = {event};
+    queue.flush();
+
+    // the mask comes back without blocking; the rest waits for the writer
+    // thread, which lists the flagged bricks and reads just those
+    cl::NDRange counts = brickCounts();
+    const size_t nx = counts[0], ny = counts[1], nz = counts[2];
+    auto flags = std::make_shared<std::vector<cl_uchar>>(nx * ny * nz);
+    cl::Event maskRead;
+    renderQueue.enqueueReadBuffer(exportMask, false, 0, flags->size(),
+        flags->data(), &waitMask, &maskRead);
+    renderQueue.flush();
+
+    const size_t brickFloats = local[0] * local[1] * local[2]
+        * __builtin_popcount(vol.channels);
+    vol.fetch = [this, flags, maskRead, waitGather, done, nx, ny,
+        brickFloats] (VolumeFrame &v) mutable
+    {
+        maskRead.wait();
+        const std::vector<cl_uchar> &f = *flags;
+        for (size_t id = 0; id < f.size(); id++) {
+            if (f[id]) {
+                v.bricks.push_back({{(cl_int) (id % nx * v.bx),
+                    (cl_int) (id / nx % ny * v.by),
+                    (cl_int) (id / (nx * ny) * v.bz), 0}});
+            }
+        }
+        v.data.resize(v.bricks.size() * brickFloats);
+
+        // one read per run of consecutive bricks
+        const size_t bytes = sizeof(cl_float) * brickFloats;
+        float *dst = v.data.data();
+        for (size_t id = 0; id < f.size(); ) {
+            size_t end = id;
+            while (end < f.size() && f[end]) {
+                end++;
+            }
+            if (end > id) {
+                renderQueue.enqueueReadBuffer(exportData, false, id * bytes,
+                    (end - id) * bytes, dst, &waitGather, &v.ready);
+                dst += (end - id) * brickFloats;
+            }
+            id = end + 1;
+        }
+        if (v.ready() != NULL) {
+            renderQueue.flush();
+            if (prof) {
+                prof->record("volumeReadback", v.ready,
+                    Profiler::LANE_RENDER);
+            }
+            v.ready.wait();
+        }
+        done.setStatus(CL_COMPLETE);
+    };
+}
+
+void Simulation::loadVolume(const VolumeFrame &vol) {
+    ensureGrid();
+    cl::NDRange local = localRange(0);
+    if (vol.nx != NX || vol.ny != NY || vol.nz != NZ || vol.bx != local[0]
+     || vol.by != local[1] || vol.bz != local[2]) {
+        std::cerr << "Error: volume is " << vol.nx << "x" << vol.ny << "x"
+            << vol.nz << " in " << vol.bx << "x" << vol.by << "x" << vol.bz
+            << " bricks, expected " << NX << "x" << NY << "x" << NZ << " in "
+            << local[0] << "x" << local[1] << "x" << local[2] << "\n";
+        exit(1);
+    }
+    if (exportData() == NULL) {
+        cl::NDRange counts = brickCounts();
+        size_t nb = counts[0] * counts[1] * counts[2];
+        exportList = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int4) * nb);
+        exportData = cl::Buffer(context, CL_MEM_READ_ONLY,
+            sizeof(cl_float) * 3 * nb * local[0] * local[1] * local[2]);
+    }
+
+    // bricks that weren't exported are empty
+    kClear.setArg(0, (cl_uint) 1);
+    kClear.setArg(1, B);
+    kClear.setArg(2, T);
+    enqueueGrid(kClear);
+    profile(CLEAR);
+
+    if (!vol.bricks.empty()) {
+        queue.enqueueWriteBuffer(exportList, true, 0,
+            sizeof(cl_int4) * vol.bricks.size(), vol.bricks.data());
+        std::vector<cl::Event> waitFetch;
+        if (exportDone() != NULL) {
+            waitFetch.push_back(exportDone);
+        }
+        queue.enqueueWriteBuffer(exportData, true, 0,
+            sizeof(cl_float) * vol.data.size(), vol.data.data(),
+            waitFetch.empty() ? NULL : &waitFetch);
+        kImportScatter.setArg(0, (cl_uint) vol.channels);
+        kImportScatter.setArg(1, exportData);
+        kImportScatter.setArg(2, T);
+        bricks = &exportList;
+        nbricks = vol.bricks.size();
+        enqueueGrid(kImportScatter);
+        profile(IMPORT_SCATTER);
+        bricks = NULL;
+    }
+    t = vol.t;
+}
+
+void Simulation::updateBricks() {
+    kActivity.setArg(0, U);
+    kActivity.setArg(1, T);
+    kActivity.setArg(2, B);
+    kActivity.setArg(3, brickMask);
+    enqueueGrid(kActivity);
+    profile(ACTIVITY);
+    queue.enqueueReadBuffer(brickMask, true, 0, mask.size(), mask.data());
+
+    cl::NDRange local = localRange(0), counts = brickCounts();
+    const int nx = counts[0], ny = counts[1], nz = counts[2];
+    const int m = scene->params.margin;
+
+    // grow the non-empty bricks by the margin, so that flow can move into
+    // empty space before it gets there
+    std::vector<cl_uchar> grown(mask.size(), 0);
+    for (int k = 0; k < nz; k++) {
+        for (int j = 0; j < ny; j++) {
+            for (int i = 0; i < nx; i++) {
+                if (!mask[(k * ny + j) * nx + i]) {
+                    continue;
+                }
+                for (int c = std::max(k-m, 0); c <= std::min(k+m, nz-1); c++)
+                    for (int b = std::max(j-m, 0); b <= std::min(j+m, ny-1); b++)
+                        for (int a = std::max(i-m, 0); a <= std::min(i+m, nx-1); a++)
+                            grown[(c * ny + b) * nx + a] = 1;
+            }
+        }
+    }
+
+    activeHost.clear();
+    clearHost.clear();
+    for (int k = 0; k < nz; k++) {
+        for (int j = 0; j < ny; j++) {
+            for (int i = 0; i < nx; i++) {
+                size_t id = (k * ny + j) * nx + i;
+                cl_int4 origin = {{(cl_int) (i * local[0]),
+                    (cl_int) (j * local[1]), (cl_int) (k * local[2]), 0}};
+                if (grown[id]) {
+                    activeHost.push_back(origin);
+                } else if (active[id]) {
+                    clearHost.push_back(origin);
+                }
+            }
+        }
+    }
+    active.swap(grown);
+    brickSteps += (double) activeHost.size() / mask.size();
+
+    if (!activeHost.empty()) {
+        queue.enqueueWriteBuffer(brickList, true, 0,
+            sizeof(cl_int4) * activeHost.size(), activeHost.data());
+    }
+
+    // bricks going idle drop their leftovers
+    if (!clearHost.empty()) {
+        queue.enqueueWriteBuffer(clearList, true, 0,
+            sizeof(cl_int4) * clearHost.size(), clearHost.data());
+        clearBricks(clearHost.size());
+    }
+}
+
+void Simulation::clearBricks(size_t n) {
+    // n bricks from clearList, or the whole grid if 0
+    cl::Buffer *saved = bricks;
+    bricks = n ? &clearList : NULL;
+    nbricks = n;
+
+    std::vector<cl::Image3D *> grids = {&U, &U_tmp, &T, &T_tmp, &Dvg, &Dvg_tmp,
+        &P, &P_tmp, &Curl};
+    if (!levels.empty()) {
+        grids.push_back(&levels[0].R);
+    }
+    for (auto g : grids) {
+        kClear.setArg(0, (cl_uint) (g == &T || g == &T_tmp));
+        kClear.setArg(1, B);
+        kClear.setArg(2, *g);
+        enqueueGrid(kClear);
+        profile(CLEAR);
+    }
+
+    bricks = saved;
 }
 
 void Simulation::setBounds() {
@@ -247,24 +1149,104 @@ void Simulation::setBounds() {
     std::swap(T, T_tmp);
 }
 
-void Simulation::addExplosion() {
+void Simulation::stepFused() {
+    // curl of the velocity as setBounds would have left it
+    kCurlBounded.setArg(0, B);
+    kCurlBounded.setArg(1, U);
+    kCurlBounded.setArg(2, Curl);
+    enqueueGrid(kCurlBounded);
+    profile(CURL_BOUNDED);
+
+    kStepFused.setArg(0, dt);
+    kStepFused.setArg(1, B);
+    kStepFused.setArg(2, U);
+    kStepFused.setArg(3, T);
+    kStepFused.setArg(4, Curl);
+    kStepFused.setArg(5, U_tmp);
+    kStepFused.setArg(6, T_tmp);
+    kStepFused.setArg(7, Dvg);
+    enqueueGrid(kStepFused);
+    profile(STEP_FUSED);
+
+    std::swap(U, U_tmp);
+    std::swap(T, T_tmp);
+}
+
+void Simulation::checkFused() {
+    cl::size_t<3> origin;
+    cl::size_t<3> region = gridRegion();
+
+    size_t n = (size_t) NX * NY * NZ;
+    std::vector<cl_float4> uRef(n), tRef(n), uFused(n), tFused(n);
+
+    queue.enqueueCopyImage(U, U_check, origin, origin, region);
+    queue.enqueueCopyImage(T, T_check, origin, origin, region);
+
+    // reference: unfused kernels
+    double b0 = traffic;
+    unsigned l0 = launches;
+    step(false);
+    double bytesRef = traffic - b0;
+    unsigned launchesRef = launches - l0;
+    queue.enqueueReadImage(U, true, origin, region, 0, 0, uRef.data());
+    queue.enqueueReadImage(T, true, origin, region, 0, 0, tRef.data());
+
+    // rewind and take the fused path, whose result is kept
+    queue.enqueueCopyImage(U_check, U, origin, origin, region);
+    queue.enqueueCopyImage(T_check, T, origin, origin, region);
+    b0 = traffic;
+    l0 = launches;
+    step(true);
+    double bytesFused = traffic - b0;
+    unsigned launchesFused = launches - l0;
+    queue.enqueueReadImage(U, true, origin, region, 0, 0, uFused.data());
+    queue.enqueueReadImage(T, true, origin, region, 0, 0, tFused.data());
+
+    float dU = 0.0f, dT = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        for (int c = 0; c < 3; c++) {
+            dU = std::max(dU, std::abs(uRef[i].s[c] - uFused[i].s[c]));
+            dT = std::max(dT, std::abs(tRef[i].s[c] - tFused[i].s[c]));
+        }
+    }
+
+    std::cout << "\nFused check, t=" << t << ": max |dU| = " << dU
+        << ", max |dT| = " << dT << "; unfused " << bytesRef * 1e-6 << " MB in "
+        << launchesRef << " launches, fused " << bytesFused * 1e-6 << " MB in "
+        << launchesFused << " launches\n";
+}
+
+// random sub-explosions as (position, size)
+std::vector<cl_float4> Simulation::explosionSpheres() {
     const float spread = 3.5;
 
-    auto kAddExplosion = cl::Kernel(program, "add_explosion");
     Explosion ex = scene->explosion;
     float volDiv = std::pow(ex.subex, 1.0/3.0f);
+    std::vector<cl_float4> spheres;
     for (unsigned i = 0; i < ex.subex; i++) {
-        cl_float3 pos = {
-            ex.pos.x + randf() * ex.size * spread,
-            ex.pos.y + randf() * ex.size * spread,
-            ex.pos.z + randf() * ex.size * spread,
-        };
+        cl_float4 s;
+        s.s[0] = ex.pos.x + randf() * ex.size * spread;
+        s.s[1] = ex.pos.y + randf() * ex.size * spread;
+        s.s[2] = ex.pos.z + randf() * ex.size * spread;
 
         // TODO: conserve total explosion volume
-        cl_float size = (ex.size + 0.4 * ex.size * randf()) / volDiv;
+        s.s[3] = (ex.size + 0.4 * ex.size * randf()) / volDiv;
+        spheres.push_back(s);
+    }
+    return spheres;
+}
 
+void Simulation::addExplosion(const std::vector<cl_float4> &spheres) {
+    // world z where this grid's layer 0 sits
+    const SimParams &p = scene->params;
+    const float z0 = slab ? ((float) slab->z0 - slab->lo())
+        / std::max(p.grid_x, std::max(p.grid_y, p.grid_z)) : 0.0f;
+
+    auto kAddExplosion = cl::Kernel(program, "add_explosion");
+    for (auto &s : spheres) {
+        cl_float3 pos = {{s.s[0], s.s[1], s.s[2] - z0}};
         kAddExplosion.setArg(0, pos);
-        kAddExplosion.setArg(1, size);
+        kAddExplosion.setArg(1, s.s[3]);
         kAddExplosion.setArg(2, T);
         kAddExplosion.setArg(3, T_tmp);
         enqueueGrid(kAddExplosion);
@@ -272,7 +1254,66 @@ void Simulation::addExplosion() {
     }
 }
 
-cl::Image3D Simulation::makeGrid3D(int ncomp, int dtype) {
+void Simulation::readFloat(cl::Image3D &img, std::vector<cl_float4> &out) {
+    if (stage() == NULL) {
+        stage = makeGrid3D(4);
+    }
+    kToFloat.setArg(0, img);
+    kToFloat.setArg(1, stage);
+    enqueueGrid(kToFloat);
+
+    cl::size_t<3> origin;
+    cl::size_t<3> region = gridRegion();
+    out.resize((size_t) NX * NY * NZ);
+    queue.enqueueReadImage(stage, true, origin, region, 0, 0, out.data());
+}
+
+void Simulation::checkHalf() {
+    compare(*reference, "Half check");
+}
+
+void Simulation::checkExport() {
+    // through the same bricks a volume file holds
+    VolumeFrame vol;
+    exportVolume(vol);
+    vol.sync();
+    replay->loadVolume(vol);
+    compare(*replay, "Export check", false);
+}
+
+void Simulation::compare(Simulation &other, const char *what, bool velocity) {
+    // U (all components pooled), temperature, smoke, fuel
+    const char *names[] = {"U", "temp", "smoke", "fuel"};
+    double maxErr[4] = {0}, sumSq[4] = {0}, maxRef[4] = {0};
+    size_t count[4] = {0};
+
+    std::vector<cl_float4> a, b;
+    for (int f = velocity ? 0 : 1; f < 2; f++) {
+        readFloat(f ? T : U, a);
+        other.readFloat(f ? other.T : other.U, b);
+        for (size_t i = 0; i < a.size(); i++) {
+            for (int c = 0; c < 3; c++) {
+                int k = f ? 1 + c : 0;
+                double d = std::abs(a[i].s[c] - b[i].s[c]);
+                maxErr[k] = std::max(maxErr[k], d);
+                maxRef[k] = std::max(maxRef[k], (double) std::abs(b[i].s[c]));
+                sumSq[k] += d * d;
+                count[k]++;
+            }
+        }
+    }
+
+    std::cout << "\n" << what << ", t=" << t << ":" << std::scientific
+        << std::setprecision(2);
+    for (int k = velocity ? 0 : 1; k < 4; k++) {
+        std::cout << " " << names[k] << " max " << maxErr[k] << " rms "
+            << std::sqrt(sumSq[k] / count[k]) << " (of " << maxRef[k] << ")"
+            << (k < 3 ? ";" : "");
+    }
+    std::cout << std::fixed << "\n";
+}
+
+cl::Image3D Simulation::makeGrid3D(int ncomp, int dtype, int level) {
     int ch;
     switch (ncomp) {
     case 1:
@@ -287,58 +1328,227 @@ cl::Image3D Simulation::makeGrid3D(int ncomp, int dtype) {
         exit(1);
     }
 
-    return cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(ch, dtype), N, N, N);
+    cl::NDRange n = gridSize(level);
+    gridBytes += n[0] * n[1] * n[2] * (ch == CL_R ? 1 : 4)
+        * (dtype == CL_FLOAT ? 4 : dtype == CL_HALF_FLOAT ? 2 : 1);
+    return cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(ch, dtype),
+        n[0], n[1], n[2]);
+}
+
+int Simulation::gridType(unsigned field, int ncomp) {
+    if (!(halfFields & field)) {
+        return CL_FLOAT;
+    }
+
+    // half RGBA is always there, half R isn't
+    std::vector<cl::ImageFormat> formats;
+    context.getSupportedImageFormats(CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE3D,
+        &formats);
+    cl_channel_order ch = ncomp == 1 ? CL_R : CL_RGBA;
+    for (auto &f : formats) {
+        if (f.image_channel_order == ch
+         && f.image_channel_data_type == CL_HALF_FLOAT) {
+            return CL_HALF_FLOAT;
+        }
+    }
+
+    std::cerr << "Warning: no " << ncomp << "-component half images on this "
+        "device, using float\n";
+    return CL_FLOAT;
 }
 
-void Simulation::enqueueGrid(cl::Kernel kernel) {
+void Simulation::enqueueGrid(cl::Kernel kernel, int level) {
+    // every grid kernel takes the brick list as its last argument
+    cl_uint nargs = kernel.getInfo<CL_KERNEL_NUM_ARGS>();
+    if (level == 0 && bricks) {
+        // one workgroup per listed brick, strung out along x
+        cl::NDRange local = localRange(0);
+        kernel.setArg(nargs - 1, *bricks);
+        lastCells = nbricks * local[0] * local[1] * local[2];
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+            cl::NDRange(nbricks * local[0], local[1], local[2]), local,
+            NULL, &event);
+        return;
+    }
+    kernel.setArg(nargs - 1, cl::Buffer());
+
+    cl::NDRange n = gridSize(level);
+    cl::NDRange local = tunedRange(kernel, level);
+    lastCells = n[0] * n[1] * n[2];
     queue.enqueueNDRangeKernel(kernel,
         cl::NullRange,          // 0 offset
-        cl::NDRange(N, N, N),   // global size
-        cl::NDRange(8, 8, 4),   // local (workgroup) size
+        Tuner::padded(n, local),    // global size, whole workgroups
+        local,                  // local (workgroup) size
         NULL, &event);
 }
 
-void Simulation::profile(int pk) {
-    if (profiling) {
-        event.wait();
-        cl_ulong t2 = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-        cl_ulong t3 = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-        kernelTimes[pk] += (t3 - t2) * 1e-9;
-        kernelCalls[pk]++;
+cl::NDRange Simulation::tunedRange(cl::Kernel &kernel, int level) {
+    if (!scene->params.autotune) {
+        return localRange(level);
     }
+    auto key = std::make_pair(kernel(), level);
+    auto it = tuned.find(key);
+    if (it != tuned.end()) {
+        return it->second;
+    }
+
+    // reductions and brick kernels work per 8x8x4 brick, or rely on
+    // running once per step
+    static const std::set<std::string> fixed = {"residual_norm", "max_speed",
+        "brick_activity", "export_mask", "export_gather", "import_scatter"};
+    if (fixed.count(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>())) {
+        return tuned[key] = localRange(level);
+    }
+
+    // launches are padded, so any shape will do
+    std::vector<cl::NDRange> candidates = {localRange(level), {8, 8, 4},
+        {16, 8, 2}, {16, 4, 4}, {32, 4, 2}, {32, 8, 1}, {64, 4, 1},
+        {16, 16, 1}, {8, 8, 8}};
+    return tuned[key] = dev->tuner->local(queue, kernel, gridSize(level),
+        candidates, true);
 }
 
-void Simulation::dumpProfiling() {
-    if (profiling) {
-        static const std::string kernelNames[_LAST] = { "advect", "curl",
-            "addForces", "reaction", "divergence", "jacobi", "project",
-            "setBounds", "render"};
-
-        std::cout << "\nProfiling info:\n";
-        printl("Kernel");
-        printr("Calls", 8);
-        printr("Time (s)");
-        printr("Mean (ms)");
-        std::cout << std::setprecision(3) << std::fixed << std::endl;
-
-        int sumC = 0;
-        double sumT = 0;
-        for (int i = 0; i < _LAST; i++) {
-            unsigned c = kernelCalls[i];
-            double t = kernelTimes[i];
-            double avg = (c ? (t / c) : 0.0) * 1e3;
-            sumC += c;
-            sumT += t;
-
-            printl(' ' + kernelNames[i]);
-            printr(c, 8);
-            printr(t);
-            printr(avg);
-            std::cout << std::endl;
+cl::NDRange Simulation::gridSize(int level) {
+    // rounded up, for the macro-cell level
+    auto n = [level](unsigned d) { return ((d - 1) >> level) + 1; };
+    return cl::NDRange(n(NX), n(NY), n(NZ));
+}
+
+cl::size_t<3> Simulation::gridRegion() {
+    cl::size_t<3> region;
+    region[0] = NX;
+    region[1] = NY;
+    region[2] = NZ;
+    return region;
+}
+
+cl::NDRange Simulation::localRange(int level) {
+    // 8x8x4, shrunk by powers of 2 to fit small grids and coarse multigrid
+    // levels
+    cl::NDRange n = gridSize(level);
+    size_t lx = 8, ly = 8, lz = 4;
+    while (lx > n[0]) lx /= 2;
+    while (ly > n[1]) ly /= 2;
+    while (lz > n[2]) lz /= 2;
+    return cl::NDRange(lx, ly, lz);
+}
+
+cl::NDRange Simulation::brickCounts() {
+    cl::NDRange local = localRange(0);
+    return cl::NDRange((NX + local[0] - 1) / local[0],
+        (NY + local[1] - 1) / local[1], (NZ + local[2] - 1) / local[2]);
+}
+
+void Simulation::profile(int pk, int lane) {
+    // render-side kernels aren't simulation traffic
+    if (pk < OCCUPANCY) {
+        traffic += kernelBytes[pk] * lastCells;
+        launches++;
+    }
+
+    if (prof) {
+        prof->record(kernelNames[pk], event, lane);
+    }
+}
+
+void Simulation::saveCheckpoint(const std::string &fname, int frame) {
+    ensureGrid();
+    cl::Image3D *grids[CK_NFIELDS] = {&U, &T, &B, &BN};
+    CheckpointHeader head = {};
+    head.nx = NX;
+    head.ny = NY;
+    head.nz = NZ;
+    head.frame = frame;
+    head.t = t;
+    head.exploded = exploded;
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        head.texelBytes[f] = grids[f]->getImageInfo<CL_IMAGE_ELEMENT_SIZE>();
+    }
+
+    // grids are stored as they are on the device, half or not
+    CheckpointWriter out(fname, head);
+    cl::size_t<3> origin;
+    cl::size_t<3> region = gridRegion();
+    std::vector<char> data;
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        data.resize((size_t) NX * NY * NZ * head.texelBytes[f]);
+        queue.enqueueReadImage(*grids[f], true, origin, region, 0, 0,
+            data.data());
+        out.write(f, data.data());
+    }
+    out.close();
+}
+
+int Simulation::loadCheckpoint(const std::string &fname) {
+    // U is about to change under the last max speed
+    speedRead = cl::Event();
+    cl::Image3D *grids[CK_NFIELDS] = {&U, &T, &B, &BN};
+    unsigned texelBytes[CK_NFIELDS];
+    for (int f = 0; f < CK_NFIELDS; f++) {
+        texelBytes[f] = grids[f]->getImageInfo<CL_IMAGE_ELEMENT_SIZE>();
+    }
+    Checkpoint ck(fname);
+    ck.check(NX, NY, NZ, texelBytes);
+
+    // uploaded in place of the starting state; sparse runs clear the
+    // grids that aren't saved once B is there
+    cl::size_t<3> origin;
+    cl::size_t<3> region = gridRegion();
+    const int order[CK_NFIELDS] = {CK_B, CK_U, CK_T, CK_BN};
+    for (int f : order) {
+        queue.enqueueWriteImage(*grids[f], true, origin, region, 0, 0,
+            const_cast<void *>(ck.grid(f)));
+        if (f == CK_B && scene->params.sparse) {
+            clearBricks(0);
         }
-        printl("Total:");
-        printr(sumC, 8);
-        printr(sumT);
-        std::cout << "\n";
+    }
+    gridReady = true;
+    t = ck.head.t;
+    exploded = ck.head.exploded;
+    setRandomState(ck.head.rng);
+
+    // whatever was active when the checkpoint was taken gets cleared by
+    // the first update if it turns out to be idle
+    if (scene->params.sparse) {
+        active.assign(active.size(), 1);
+    }
+    if (reference) {
+        std::cerr << "Warning: halfcheck doesn't survive a restore, disabled\n";
+        reference.reset();
+    }
+    return ck.head.frame;
+}
+
+BackendStats Simulation::stats() {
+    return {steps, gridBytes};
+}
+
+void Simulation::dumpProfiling() {
+    if (prof && steps) {
+        std::cout << "\nSimulation: " << std::setprecision(1)
+            << traffic / steps * 1e-6 << " MB moved/step in "
+            << (double) launches / steps << " launches/step ("
+            << (scene->params.fused == FUSED_ON ? "fused"
+                : scene->params.fused == FUSED_CHECK ? "both paths" : "unfused")
+            << ")\n";
+    }
+    if (prof && scene->params.sparse && steps) {
+        std::cout << "\nSparse: " << std::setprecision(1)
+            << 100.0 * brickSteps / steps << "% of " << mask.size()
+            << " bricks active on average\n";
+    }
+    if (prof && cfl > 0 && frames) {
+        std::cout << "\nAdaptive dt: " << std::setprecision(2)
+            << (double) steps / frames << " steps/frame on average, "
+            << maxSteps << " at most\n";
+    }
+    if (normRead[normLast]() != NULL) {
+        mgResidual = residualNorm(normLast);
+    }
+    if (prof && mgSolves) {
+        std::cout << "\nMultigrid: " << mgSolves << " solves, "
+            << std::setprecision(2) << (double) mgCycles / mgSolves
+            << " V-cycles/solve, last residual "
+            << std::scientific << mgResidual << std::fixed << "\n";
     }
 }
@@ -5,57 +5,149 @@
 
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
+#include <map>
+#include <memory>
+#include <vector>
 
+#include "backend.h"
+#include "device.h"
 #include "scene.h"
+#include "slab.h"
 #include "util.h"
 
-class Simulation {
+class Simulation : public Backend {
 public:
-    Simulation(Scene *sc, bool prof=true);
+    // runs on dev, or opens the default device if that's null; a reference
+    // run keeps every grid in float, for halfcheck; given a slab, only that
+    // part of the grid is simulated (see SlabSimulation)
+    Simulation(Scene *sc, Profiler *prof=NULL, ClDevicePtr device=NULL,
+        bool isReference=false, const Slab *slab=NULL);
 
     void advance();
     float getT();
 
-    void render(HostImage &img);
+    void render(const std::vector<HostImage *> &imgs);
+    void preview(const std::vector<HostImage *> &imgs, int scale, int pass);
+    void exportVolume(VolumeFrame &vol);
+    void loadVolume(const VolumeFrame &vol);
 
     void dumpProfiling();
+    BackendStats stats();
+
+    void saveCheckpoint(const std::string &fname, int frame);
+    int loadCheckpoint(const std::string &fname);
 
 private:
+    friend class SlabSimulation;
+
     // initialization
     void initOpenCL();
+    std::string buildOptions(int sampleDiv=1) const;
+    unsigned wallMask() const;
     void initGrid();
+    // initGrid and the sparse clear, on first use, unless a checkpoint has
+    // been loaded instead
+    void ensureGrid();
     void initRenderer();
-    void initProfiling();
+
+    // snapshot (when overlapping), occupancy and light volume shared by
+    // every view of a render; returns the T to render from
+    cl::Image3D prepareRender();
 
     // fluid dynamics
+    void update();
+    void step(bool fused);
     void advect();
     void addForces();
     void reaction();
-    void project();
+    void project(bool fused=false);
     void setBounds();
-    void addExplosion();
+    std::vector<cl_float4> explosionSpheres();
+    void addExplosion(const std::vector<cl_float4> &spheres);
+
+    // fused equivalent of setBounds, addForces and reaction
+    void stepFused();
+    void checkFused();
+
+    // multigrid pressure solve
+    void initMultigrid();
+    void multigrid();
+    void vcycle(int l);
+    void smooth(int l, int iters);
+    // relative residual of level 0: start reading it back into slot 0 or
+    // 1, then wait for it
+    void requestResidualNorm(int slot);
+    float residualNorm(int slot);
+
+    // adaptive time step
+    // max |u| over the grid (all slabs), from the readback started by
+    // requestMaxSpeed() after the last step, or a new one
+    void requestMaxSpeed();
+    float maxSpeed();
+    float cflStep(float remaining);
+
+    // half precision storage
+    int gridType(unsigned field, int ncomp);
+    void readFloat(cl::Image3D &img, std::vector<cl_float4> &out);
+    void checkHalf();
+    // export T, load it into the replay run, and compare
+    void checkExport();
+    // print how far U (unless !velocity) and T are from other's, titled what
+    void compare(Simulation &other, const char *what, bool velocity=true);
+
+    // brick-sparse stepping
+    void initSparse();
+    void updateBricks();
+    void clearBricks(size_t n);
+
+    // volume export
+    void initExport();
+
+    // z-slabs: refresh the images' ghost layers from the neighbouring slabs
+    void halo(const std::vector<cl::Image3D *> &imgs);
 
     // helper functions
-    cl::Image3D makeGrid3D(int ncomp, int dtype=CL_FLOAT);
-    void enqueueGrid(cl::Kernel k);
-    void profile(int pk);
+    cl::Image3D makeGrid3D(int ncomp, int dtype=CL_FLOAT, int level=0);
+    void enqueueGrid(cl::Kernel k, int level=0);
+    cl::NDRange gridSize(int level=0);
+    cl::size_t<3> gridRegion();
+    cl::NDRange localRange(int level);
+    // fine-level workgroups (bricks) along each axis, rounded up
+    cl::NDRange brickCounts();
+    // the device's tuned workgroup for kernel at level (see tuner.h), or
+    // localRange() if autotune is off
+    cl::NDRange tunedRange(cl::Kernel &kernel, int level);
+    void profile(int pk, int lane=Profiler::LANE_SIM);
 
     const Scene *scene;
-    const bool profiling;
-    const float dt;
-    const unsigned N;
+    Profiler *const prof;
+    const Slab *const slab;     // part of the grid simulated here, or NULL
+    const float frameDt;        // time between frames
+    const float cfl;            // CFL target, 0 = fixed steps; see cflStep
+    float dt;                   // current step size
+    const unsigned NX, NY, NZ;
+    const unsigned halfFields;  // GridField bits stored as half
     float t;
+    bool exploded;
+    bool gridReady;             // U, T, B and BN hold a state
 
     // OpenCL management
+    ClDevicePtr dev;
     cl::Program program;
     cl::Context context;
     cl::CommandQueue queue;
+    cl::CommandQueue renderQueue;   // same as queue unless overlapping
 
     // all kernel handles
     cl::Kernel kAdvect, kCurl, kAddForces, kReaction, kDivergence, kJacobi,
-        kProject, kSetBounds, kRender;
+        kProject, kSetBounds, kRender,
+        kSmooth, kResidual, kRestrict, kProlong, kResidualNorm,
+        kCurlBounded, kStepFused, kDivergenceJacobi,
+        kActivity, kClear, kOccupancy, kLightVolume, kToFloat,
+        kExportMask, kExportGather, kImportScatter, kMaxSpeed;
 
     cl::NDRange gridRange, groupRange;
+    std::map<std::pair<cl_kernel, int>, cl::NDRange> tuned;
 
     // state variables
     cl::Image3D U, U_tmp,       // velocity vector field
@@ -67,16 +159,77 @@ private:
                 P, P_tmp,       // pressure
                 Curl;           // curl (with magnitude as 4th component)
 
-    cl::Image2D target;         // render target
+    // multigrid hierarchy; level 0 aliases P, P_tmp and Dvg during a solve
+    struct Level {
+        cl::Image3D P, P_tmp,   // solution (pressure or coarse correction)
+                    F,          // right-hand side
+                    R;          // residual
+    };
+    std::vector<Level> levels;
+    cl::Buffer normPartial;
+    std::vector<cl_float2> normHost[2];
+    size_t normCount[2];
+    cl::Event normRead[2];      // pending readbacks, if any
+    int normLast;               // slot of the last solve's final norm
+    unsigned mgSolves, mgCycles;
+    float mgResidual;
+
+    cl::Buffer speedPartial;    // per-workgroup max |u|^2
+    cl::Event speedRead;        // pending readback of it, if any
+    std::vector<cl_float> speedHost;
+
+    cl::Image3D U_check, T_check;   // step starting state, for FUSED_CHECK
+
+    std::unique_ptr<Simulation> reference;  // float run, for halfcheck
+    std::unique_ptr<Simulation> replay;     // loads exports, for exportcheck
+    cl::Image3D stage;          // float copy of a grid, for reading back
+    size_t gridBytes;           // device memory used by grids
+
+    // active bricks; level 0 grid launches cover only the bricks listed in
+    // *bricks, or the whole grid when it is NULL
+    cl::Buffer brickMask, brickList, clearList;
+    std::vector<cl_uchar> mask, active;
+    std::vector<cl_int4> activeHost, clearHost;
+    cl::Buffer *bricks;
+    size_t nbricks;
+    double brickSteps;          // sum of active fractions, for the report
+
+    cl::Image3D T_snap;         // copy of T for overlapped rendering
+    cl::Event renderDone;       // last render's read of T_snap
+
+    cl::Image3D Occ;            // max density per macro-cell
+    cl::Buffer occBox;          // bounding box of occupied macro-cells
+    cl::Image3D Lvol;           // light reaching each voxel
+
+    // exported or imported bricks of T, packed; exportDone is set once the
+    // last export's bricks have been read out of exportData
+    cl::Buffer exportMask, exportList, exportData;
+    cl::UserEvent exportDone;
+
+    std::vector<cl::Image2D> targets;   // render target per camera
+
+    // progressive preview: kernels built for previewScale (0 = none yet),
+    // samples so far per camera, and the T being refined
+    cl::Kernel kPreview, kResolve;
+    int previewScale;
+    std::vector<cl::Buffer> previewAccum;
+    cl::Image3D previewT;
     cl::Image2D bbspec;         // blackbody RGB spectrum
 
     // profiling
-    enum {ADVECT, CURL, ADD_FORCES, REACTION, DIVERGENCE, JACOBI, PROJECT,
-        SET_BOUNDS, RENDER, _LAST};
+    enum {ADVECT, CURL, ADD_FORCES, REACTION, DIVERGENCE, JACOBI, SMOOTH,
+        RESIDUAL, RESTRICT, PROLONG, PROJECT, SET_BOUNDS, CURL_BOUNDED,
+        STEP_FUSED, DIVERGENCE_JACOBI, ACTIVITY, CLEAR, MAX_SPEED, OCCUPANCY,
+        LIGHT_VOLUME, EXPORT_MASK, EXPORT_GATHER, IMPORT_SCATTER, RENDER,
+        _LAST};
 
-    double kernelTimes[_LAST];
-    unsigned kernelCalls[_LAST];
     cl::Event event;
+
+    // estimated memory traffic of the simulation kernels
+    size_t lastCells;           // size of the last grid launch
+    double traffic;             // bytes
+    unsigned launches, steps;
+    unsigned frames, maxSteps;  // steps per frame, with adaptive dt
 };
 
 #endif // __SIMULATION_H__
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "slab.h"
+#include "simulation.h"
+
+SlabLink::SlabLink(int nslabs) :
+    down(nslabs), up(nslabs), nslabs(nslabs), waiting(0), generation(0),
+    aborted(false), values(nslabs) {}
+
+void SlabLink::wait() {
+    std::unique_lock<std::mutex> lock(mtx);
+    unsigned gen = generation;
+    if (aborted) {
+        throw SlabAbort();
+    }
+    if (++waiting == nslabs) {
+        waiting = 0;
+        generation++;
+        cv.notify_all();
+    } else {
+        cv.wait(lock, [&] { return generation != gen || aborted; });
+        if (aborted) {
+            throw SlabAbort();
+        }
+    }
+}
+
+void SlabLink::abort() {
+    std::lock_guard<std::mutex> lock(mtx);
+    aborted = true;
+    cv.notify_all();
+}
+
+float SlabLink::reduceMax(int slab, float v) {
+    values[slab] = v;
+    wait();
+    float m = *std::max_element(values.begin(), values.end());
+    // nobody overwrites values until everybody has read them
+    wait();
+    return m;
+}
+
+SlabSimulation::SlabSimulation(Scene *sc, Profiler *prof) :
+    scene(sc), prof(prof), viewFresh(true), stepSecs(0.0), gatherSecs(0.0)
+{
+    const SimParams &p = sc->params;
+    if (p.solver != SOLVER_JACOBI || p.sparse || p.fused != FUSED_OFF
+     || (p.half && p.halfcheck > 0)) {
+        std::cerr << "Error: slabs need the Jacobi solver, and no sparse, "
+            "fused or halfcheck\n";
+        exit(1);
+    }
+    if (p.cfl <= 0 || p.cfl > SLAB_HALO - 1) {
+        std::cerr << "Warning: slabs step with cfl " << slabCfl(p.cfl)
+            << ", or advection would reach past their ghost layers\n";
+    }
+
+    // GPUs first: a CPU only helps if there aren't enough of them
+    auto devs = openDevices(p.slabs);
+    if (devs.empty()) {
+        std::cerr << "Error: no OpenCL devices\n";
+        exit(1);
+    }
+    std::stable_partition(devs.begin(), devs.end(), [](const ClDevicePtr &d) {
+        return d->device.getInfo<CL_DEVICE_TYPE>() != CL_DEVICE_TYPE_CPU;
+    });
+
+    // whole bricks (4 layers deep) per slab, as even as it gets, the last
+    // slab also taking any partial one; no slab is thinner than its ghost
+    // layers. Slabs only share a device when checking
+    static_assert(SLAB_HALO <= 4, "slabs must hold their ghost layers");
+    const int units = p.grid_z / 4;
+    int n = std::max(1, std::min(p.slabs, units));
+    if (p.slabcheck <= 0) {
+        n = std::min(n, (int) devs.size());
+    }
+    if (n < p.slabs) {
+        std::cerr << "Warning: splitting into " << n << " slabs, not "
+            << p.slabs << "\n";
+    }
+
+    link.reset(new SlabLink(n));
+    slabs.resize(n);
+    unsigned z0 = 0;
+    for (int k = 0; k < n; k++) {
+        unsigned nz = 4 * (units / n + (k < units % n ? 1 : 0));
+        if (k == n-1) {
+            nz = p.grid_z - z0;     // plus grid_z % 4
+        }
+        slabs[k] = {k, n, z0, nz, link.get()};
+        z0 += nz;
+    }
+
+    // the view isn't stepped; it just holds the whole grid for rendering
+    view.reset(new Simulation(sc, prof, devs[0]));
+
+    // only the first slab is profiled, the others do the same work
+    for (int k = 0; k < n; k++) {
+        sims.emplace_back(new Simulation(sc, k == 0 ? prof : NULL,
+            devs[k % devs.size()], false, &slabs[k]));
+    }
+
+    // the unsplit run is a single slab, so it steps the same way
+    if (p.slabcheck > 0) {
+        std::cout << "Unsplit run for slabcheck:\n";
+        checkLink.reset(new SlabLink(1));
+        checkSlab = {0, 1, 0, (unsigned) p.grid_z, checkLink.get()};
+        whole.reset(new Simulation(sc, NULL, devs[0], false, &checkSlab));
+    }
+}
+
+SlabSimulation::~SlabSimulation() {}
+
+void SlabSimulation::advance() {
+    auto t0 = time_now();
+
+    // the explosion, drawn here rather than up front so a restored run
+    // draws it from the checkpoint's rng state
+    if (sims[0]->t > 0.2 && !sims[0]->exploded) {
+        link->spheres = view->explosionSpheres();
+        if (checkLink) {
+            checkLink->spheres = link->spheres;
+        }
+    }
+
+    // a failing slab stops the others at their next wait, and its error
+    // is rethrown here rather than ending the process from its thread
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(sims.size());
+    for (size_t k = 0; k < sims.size(); k++) {
+        Simulation *s = sims[k].get();
+        SlabLink *l = link.get();
+        std::exception_ptr *err = &errors[k];
+        threads.emplace_back([s, l, err] {
+            try {
+                s->advance();
+            } catch (const SlabAbort &) {
+            } catch (...) {
+                *err = std::current_exception();
+                l->abort();
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (auto &err : errors) {
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+    stepSecs += time_since(t0);
+    viewFresh = false;
+
+    if (whole) {
+        whole->advance();
+        if (sims[0]->frames % scene->params.slabcheck == 0) {
+            gather(true);
+            view->compare(*whole, "Slab check");
+        }
+    }
+}
+
+float SlabSimulation::getT() {
+    // the view is ahead when re-rendering
+    return viewFresh ? view->getT() : sims[0]->getT();
+}
+
+void SlabSimulation::gather(bool everything) {
+    auto t0 = time_now();
+    view->ensureGrid();
+    std::vector<cl::Image3D *> from, to;
+    std::vector<char> data;
+    for (size_t k = 0; k < sims.size(); k++) {
+        Simulation &s = *sims[k];
+        from = {&s.T};
+        to = {&view->T};
+        if (everything) {
+            from.push_back(&s.U);
+            to.push_back(&view->U);
+        }
+
+        cl::size_t<3> src, dst;
+        cl::size_t<3> region = s.gridRegion();
+        src[2] = slabs[k].lo();
+        dst[2] = slabs[k].z0;
+        region[2] = slabs[k].nz;
+        for (size_t f = 0; f < from.size(); f++) {
+            data.resize(region[0] * region[1] * region[2]
+                * from[f]->getImageInfo<CL_IMAGE_ELEMENT_SIZE>());
+            s.queue.enqueueReadImage(*from[f], true, src, region, 0, 0,
+                data.data());
+            view->queue.enqueueWriteImage(*to[f], true, dst, region, 0, 0,
+                data.data());
+        }
+    }
+    view->t = sims[0]->t;
+    view->exploded = sims[0]->exploded;
+    viewFresh = true;
+    gatherSecs += time_since(t0);
+}
+
+void SlabSimulation::scatter() {
+    std::vector<char> data;
+    for (size_t k = 0; k < sims.size(); k++) {
+        Simulation &s = *sims[k];
+        cl::Image3D *from[] = {&view->U, &view->T},
+                    *to[] = {&s.U, &s.T};
+
+        // B has the slab's own walls, so only U and T come from the view;
+        // ghost layers included
+        s.ensureGrid();
+        cl::size_t<3> src, dst;
+        cl::size_t<3> region = s.gridRegion();
+        src[2] = slabs[k].z0 - slabs[k].lo();
+        for (int f = 0; f < 2; f++) {
+            data.resize(region[0] * region[1] * region[2]
+                * from[f]->getImageInfo<CL_IMAGE_ELEMENT_SIZE>());
+            view->queue.enqueueReadImage(*from[f], true, src, region, 0, 0,
+                data.data());
+            s.queue.enqueueWriteImage(*to[f], true, dst, region, 0, 0,
+                data.data());
+        }
+        s.t = view->t;
+        s.exploded = view->exploded;
+    }
+}
+
+void SlabSimulation::render(const std::vector<HostImage *> &imgs) {
+    if (!viewFresh) {
+        gather(false);
+    }
+    view->render(imgs);
+}
+
+void SlabSimulation::preview(const std::vector<HostImage *> &imgs, int scale,
+    int pass)
+{
+    if (!viewFresh) {
+        gather(false);
+    }
+    view->preview(imgs, scale, pass);
+}
+
+void SlabSimulation::exportVolume(VolumeFrame &vol) {
+    if (!viewFresh) {
+        gather(false);
+    }
+    view->exportVolume(vol);
+}
+
+void SlabSimulation::loadVolume(const VolumeFrame &vol) {
+    // only for re-rendering, which never steps the slabs
+    view->loadVolume(vol);
+    viewFresh = true;
+}
+
+void SlabSimulation::dumpProfiling() {
+    sims[0]->dumpProfiling();
+    const unsigned frames = sims[0]->frames;
+    if (prof && frames) {
+        std::cout << "\nSlabs: " << sims.size() << " devices, "
+            << std::setprecision(2) << 1e3 * stepSecs / frames
+            << " ms/frame stepping, " << 1e3 * gatherSecs / frames
+            << " ms/frame gathering for output\n";
+    }
+}
+
+BackendStats SlabSimulation::stats() {
+    BackendStats s = {sims[0]->steps, view->gridBytes};
+    for (auto &sim : sims) {
+        s.gridBytes += sim->gridBytes;
+    }
+    return s;
+}
+
+void SlabSimulation::saveCheckpoint(const std::string &fname, int frame) {
+    gather(true);
+    view->saveCheckpoint(fname, frame);
+}
+
+int SlabSimulation::loadCheckpoint(const std::string &fname) {
+    if (whole) {
+        std::cerr << "Warning: slabcheck doesn't survive a restore, disabled\n";
+        whole.reset();
+    }
+    int frame = view->loadCheckpoint(fname);
+    scatter();
+    viewFresh = true;
+    return frame;
+}
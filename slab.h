@@ -0,0 +1,118 @@
+/* -*- C++ -*- */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "backend.h"
+
+class Simulation;
+
+// ghost layers on each inner face of a slab; semi-Lagrangian advection
+// reads at most this many cells across a face, so keep cfl below it
+const unsigned SLAB_HALO = 4;
+
+// the CFL target slabs step with: cfl, up to a cell short of the ghost
+// layers, or that if cfl is off
+inline float slabCfl(float cfl) {
+    const float most = SLAB_HALO - 1;
+    return cfl > 0 ? std::min(cfl, most) : most;
+}
+
+// thrown out of SlabLink::wait() in the other slabs' threads when one of
+// them has failed
+struct SlabAbort {};
+
+// what the slabs of one grid share: a barrier, and the layers each slab
+// hands to its neighbours
+class SlabLink {
+public:
+    SlabLink(int nslabs);
+
+    // blocks until every slab has called it, or throws SlabAbort
+    void wait();
+
+    // a slab's thread has failed: wake the others and fail their waits
+    void abort();
+
+    // the max of v over all slabs, for every slab
+    float reduceMax(int slab, float v);
+
+    // interior layers next to the lower and upper face of each slab
+    std::vector<std::vector<char>> down, up;
+
+    // the explosion, drawn once for all slabs
+    std::vector<cl_float4> spheres;
+
+private:
+    const int nslabs;
+    std::mutex mtx;
+    std::condition_variable cv;
+    int waiting;
+    unsigned generation;
+    bool aborted;
+
+    std::vector<float> values;
+};
+
+// one z-slab of a grid split across devices: global layers z0..z0+nz-1,
+// plus SLAB_HALO ghost layers on each face shared with another slab
+struct Slab {
+    int index, count;
+    unsigned z0, nz;
+    SlabLink *link;
+
+    unsigned lo() const { return index > 0 ? SLAB_HALO : 0; }
+    unsigned hi() const { return index < count-1 ? SLAB_HALO : 0; }
+    unsigned localNz() const { return lo() + nz + hi(); }
+};
+
+// the OpenCL backend with the grid split into z-slabs, one per device,
+// each stepped by its own thread; rendering, export and checkpoints go
+// through a full-size Simulation on the first device that T (and U, for
+// checkpoints) is gathered into
+class SlabSimulation : public Backend {
+public:
+    SlabSimulation(Scene *sc, Profiler *prof=NULL);
+    ~SlabSimulation();
+
+    void advance();
+    float getT();
+
+    void render(const std::vector<HostImage *> &imgs);
+    void preview(const std::vector<HostImage *> &imgs, int scale, int pass);
+    void exportVolume(VolumeFrame &vol);
+    void loadVolume(const VolumeFrame &vol);
+
+    void dumpProfiling();
+    BackendStats stats();
+
+    void saveCheckpoint(const std::string &fname, int frame);
+    int loadCheckpoint(const std::string &fname);
+
+private:
+    // copy T (or U and T) between the slabs and the view
+    void gather(bool everything);
+    void scatter();
+
+    const Scene *scene;
+    Profiler *const prof;
+    std::unique_ptr<SlabLink> link;
+    std::vector<Slab> slabs;
+    std::vector<std::unique_ptr<Simulation>> sims;
+    std::unique_ptr<Simulation> view;
+
+    // unsplit run for slabcheck, or null
+    std::unique_ptr<SlabLink> checkLink;
+    Slab checkSlab;
+    std::unique_ptr<Simulation> whole;
+    bool viewFresh;             // view's T matches the slabs'
+    double stepSecs, gatherSecs;
+};
+
+#endif // __SLAB_H__
@@ -0,0 +1,75 @@
+#include <algorithm>
+
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(unsigned n) :
+    busy(0), stopping(false)
+{
+    if (n == 0) {
+        n = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < n; i++) {
+        threads.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cvTask.notify_all();
+    for (auto &th : threads) {
+        th.join();
+    }
+}
+
+void ThreadPool::run(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tasks.push_back(std::move(task));
+    }
+    cvTask.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cvDone.wait(lock, [this] { return tasks.empty() && busy == 0; });
+}
+
+void ThreadPool::parallelFor(int n, std::function<void(int, int)> f) {
+    // a few chunks per thread, so uneven slabs still balance out
+    int nchunks = std::min<int>(n, 4 * size());
+    for (int c = 0; c < nchunks; c++) {
+        int begin = (long) n * c / nchunks,
+            end = (long) n * (c+1) / nchunks;
+        run([=] { f(begin, end); });
+    }
+    wait();
+}
+
+void ThreadPool::worker() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cvTask.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            busy++;
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            busy--;
+            if (tasks.empty() && busy == 0) {
+                cvDone.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,38 @@
+/* -*- C++ -*- */
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed set of worker threads pulling tasks from a shared queue
+class ThreadPool {
+public:
+    ThreadPool(unsigned n=0);   // 0 = one per hardware thread
+    ~ThreadPool();
+
+    void run(std::function<void()> task);
+    void wait();
+
+    // split [0, n) into contiguous ranges, run f(begin, end) on each and wait
+    void parallelFor(int n, std::function<void(int, int)> f);
+
+    unsigned size() const { return threads.size(); }
+
+private:
+    void worker();
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable cvTask, cvDone;
+    unsigned busy;
+    bool stopping;
+};
+
+#endif // __THREADPOOL_H__
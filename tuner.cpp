@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "tuner.h"
+#include "device.h"
+#include "util.h"
+
+// timed launches per candidate, after one to warm up
+static const int TUNE_REPS = 3;
+
+// kernel name and launch size, e.g. "advect 128x128x128"
+static std::string tuneKey(cl::Kernel &kernel, const cl::NDRange &global) {
+    std::ostringstream key;
+    key << kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << " ";
+    for (size_t d = 0; d < global.dimensions(); d++) {
+        key << (d ? "x" : "") << global[d];
+    }
+    return key.str();
+}
+
+static cl::NDRange makeRange(const std::vector<size_t> &v) {
+    switch (v.size()) {
+    case 1: return cl::NDRange(v[0]);
+    case 2: return cl::NDRange(v[0], v[1]);
+    default: return cl::NDRange(v[0], v[1], v[2]);
+    }
+}
+
+Tuner::Tuner(const cl::Device &device) : device(device) {
+    maxItems = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+    const std::string dir = cacheDir();
+    if (dir.empty()) {
+        return;
+    }
+    std::ostringstream name;
+    name << dir << "/tuning-" << std::hex << std::setfill('0') << std::setw(16)
+        << hashKey(deviceIdentity(device)) << ".txt";
+    fname = name.str();
+
+    // one "kernel size lx ly lz" per line; later lines win
+    std::ifstream in(fname);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream words(line);
+        std::string kernel, size;
+        std::vector<size_t> local;
+        size_t n;
+        words >> kernel >> size;
+        while (words >> n) {
+            local.push_back(n);
+        }
+        if (!kernel.empty() && !local.empty() && local.size() <= 3) {
+            best[kernel + " " + size] = local;
+        }
+    }
+}
+
+bool Tuner::fits(cl::Kernel &kernel, const cl::NDRange &global,
+    const cl::NDRange &local, bool pad)
+{
+    if (local.dimensions() != global.dimensions()) {
+        return false;
+    }
+    size_t items = 1;
+    for (size_t d = 0; d < local.dimensions(); d++) {
+        if (local[d] == 0 || (d < maxItems.size() && local[d] > maxItems[d])
+         || (!pad && global[d] % local[d] != 0)) {
+            return false;
+        }
+        items *= local[d];
+    }
+    return items <= kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+}
+
+cl::NDRange Tuner::padded(const cl::NDRange &global, const cl::NDRange &local) {
+    std::vector<size_t> v(global.dimensions());
+    for (size_t d = 0; d < v.size(); d++) {
+        v[d] = (global[d] + local[d] - 1) / local[d] * local[d];
+    }
+    return makeRange(v);
+}
+
+cl::NDRange Tuner::local(const cl::CommandQueue &queue, cl::Kernel &kernel,
+    const cl::NDRange &global, const std::vector<cl::NDRange> &candidates,
+    bool pad)
+{
+    const std::string key = tuneKey(kernel, global);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = best.find(key);
+        if (it != best.end()) {
+            return makeRange(it->second);
+        }
+    }
+
+    cl::NDRange winner = candidates.front();
+    double winnerSecs = -1.0;
+    for (auto &local : candidates) {
+        if (!fits(kernel, global, local, pad)) {
+            continue;
+        }
+        const cl::NDRange range = pad ? padded(global, local) : global;
+        try {
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, range, local);
+            queue.finish();
+            auto t0 = time_now();
+            for (int r = 0; r < TUNE_REPS; r++) {
+                queue.enqueueNDRangeKernel(kernel, cl::NullRange, range, local);
+            }
+            queue.finish();
+            double secs = time_since(t0);
+            if (winnerSecs < 0.0 || secs < winnerSecs) {
+                winner = local;
+                winnerSecs = secs;
+            }
+        } catch (cl::Error) {
+            // e.g. out of resources for this shape; try the next one
+        }
+    }
+
+    std::vector<size_t> v(winner.dimensions());
+    for (size_t d = 0; d < v.size(); d++) {
+        v[d] = winner[d];
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    best[key] = v;
+    if (winnerSecs >= 0.0 && !fname.empty()) {
+        std::ofstream out(fname, std::ios::app);
+        out << key;
+        for (size_t n : v) {
+            out << " " << n;
+        }
+        out << "\n";
+    }
+    return winner;
+}
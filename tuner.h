@@ -0,0 +1,46 @@
+/* -*- C++ -*- */
+
+#ifndef __TUNER_H__
+#define __TUNER_H__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+// Workgroup shapes per kernel and launch size on one device: the first
+// launch times every candidate, and the winners are kept in the cache
+// directory (see device.h) for later runs.
+class Tuner {
+public:
+    Tuner(const cl::Device &device);
+
+    // the fastest of candidates for kernel over global; timing runs the
+    // launch several times, so it must give the same result every time.
+    // With pad, global is rounded up to each candidate (see padded()) and
+    // the kernel skips work-items past the end; otherwise candidates that
+    // don't divide global are skipped, falling back to the first one.
+    cl::NDRange local(const cl::CommandQueue &queue, cl::Kernel &kernel,
+        const cl::NDRange &global, const std::vector<cl::NDRange> &candidates,
+        bool pad=false);
+
+    // global rounded up to a multiple of local
+    static cl::NDRange padded(const cl::NDRange &global,
+        const cl::NDRange &local);
+
+private:
+    bool fits(cl::Kernel &kernel, const cl::NDRange &global,
+        const cl::NDRange &local, bool pad);
+
+    const cl::Device device;
+    std::string fname;          // empty if there's no cache directory
+    std::vector<size_t> maxItems;
+
+    std::mutex mtx;
+    std::map<std::string, std::vector<size_t>> best;
+};
+
+#endif // __TUNER_H__
@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <random>
+#include <zlib.h>
 
 #include "util.h"
 
@@ -26,10 +29,138 @@ HostImage::~HostImage() {
     delete [] data;
 }
 
-void HostImage::write(std::string fname) {
+void HostImage::write(std::string fname) const {
     stbi_write_png(fname.c_str(), w, h, 4, data, 0);
 }
 
+void HostImage::sync() {
+    if (ready() != NULL) {
+        ready.wait();
+        ready = cl::Event();
+    }
+}
+
+VolumeFrame::VolumeFrame() :
+    nx(0), ny(0), nz(0), bx(0), by(0), bz(0), channels(0), t(0)
+{
+}
+
+void VolumeFrame::write(std::string fname) {
+    static const uint32_t bricksPerChunk = 64;
+
+    VolumeHeader head = {};
+    memcpy(head.magic, "EXPLVOL", 8);
+    head.version = 1;
+    head.nx = nx;
+    head.ny = ny;
+    head.nz = nz;
+    head.bx = bx;
+    head.by = by;
+    head.bz = bz;
+    head.channels = channels;
+    head.nbricks = bricks.size();
+    head.nchunks = (head.nbricks + bricksPerChunk - 1) / bricksPerChunk;
+    head.bricksPerChunk = bricksPerChunk;
+    head.t = t;
+
+    // chunks are compressed independently, so readers can seek to a brick
+    size_t brickFloats = data.size() / std::max<size_t>(bricks.size(), 1);
+    std::vector<std::vector<Bytef>> chunks(head.nchunks);
+    std::vector<uint64_t> sizes(head.nchunks);
+    for (uint32_t c = 0; c < head.nchunks; c++) {
+        size_t b0 = c * bricksPerChunk,
+               b1 = std::min<size_t>(b0 + bricksPerChunk, bricks.size());
+        uLong srcLen = (b1 - b0) * brickFloats * sizeof(float);
+        uLongf len = compressBound(srcLen);
+        chunks[c].resize(len);
+        if (compress2(chunks[c].data(), &len,
+                (const Bytef *) &data[b0 * brickFloats], srcLen, 1) != Z_OK) {
+            std::cerr << "Error: compressing " << fname << " failed\n";
+            exit(1);
+        }
+        sizes[c] = len;
+    }
+
+    std::vector<int32_t> origins;
+    for (auto &b : bricks) {
+        origins.insert(origins.end(), {b.s[0], b.s[1], b.s[2]});
+    }
+
+    std::ofstream out(fname, std::ios::binary);
+    out.write((const char *) &head, sizeof(head));
+    out.write((const char *) origins.data(), origins.size() * sizeof(int32_t));
+    out.write((const char *) sizes.data(), sizes.size() * sizeof(uint64_t));
+    for (uint32_t c = 0; c < head.nchunks; c++) {
+        out.write((const char *) chunks[c].data(), sizes[c]);
+    }
+    if (!out) {
+        std::cerr << "Error: couldn't write '" << fname << "'\n";
+        exit(1);
+    }
+}
+
+void VolumeFrame::read(std::string fname) {
+    std::ifstream in(fname, std::ios::binary);
+    VolumeHeader head;
+    if (!in.read((char *) &head, sizeof(head))) {
+        std::cerr << "Error: couldn't read '" << fname << "'\n";
+        exit(1);
+    }
+    if (memcmp(head.magic, "EXPLVOL", 8) != 0 || head.version != 1) {
+        std::cerr << "Error: '" << fname << "' is not a version 1 volume\n";
+        exit(1);
+    }
+    nx = head.nx;
+    ny = head.ny;
+    nz = head.nz;
+    bx = head.bx;
+    by = head.by;
+    bz = head.bz;
+    channels = head.channels;
+    t = head.t;
+
+    std::vector<int32_t> origins(3 * head.nbricks);
+    std::vector<uint64_t> sizes(head.nchunks);
+    in.read((char *) origins.data(), origins.size() * sizeof(int32_t));
+    in.read((char *) sizes.data(), sizes.size() * sizeof(uint64_t));
+    bricks.resize(head.nbricks);
+    for (size_t b = 0; b < bricks.size(); b++) {
+        bricks[b] = {{origins[3*b], origins[3*b+1], origins[3*b+2], 0}};
+    }
+
+    size_t nch = 0;
+    for (unsigned c = channels; c; c >>= 1) {
+        nch += c & 1;
+    }
+    size_t brickFloats = (size_t) bx * by * bz * nch;
+    data.resize(bricks.size() * brickFloats);
+    std::vector<Bytef> chunk;
+    for (uint32_t c = 0; c < head.nchunks; c++) {
+        size_t b0 = (size_t) c * head.bricksPerChunk,
+               b1 = std::min<size_t>(b0 + head.bricksPerChunk, bricks.size());
+        chunk.resize(sizes[c]);
+        in.read((char *) chunk.data(), sizes[c]);
+        uLongf len = (b1 - b0) * brickFloats * sizeof(float);
+        if (!in || uncompress((Bytef *) &data[b0 * brickFloats], &len,
+                chunk.data(), sizes[c]) != Z_OK) {
+            std::cerr << "Error: '" << fname << "' is corrupt\n";
+            exit(1);
+        }
+    }
+}
+
+void VolumeFrame::sync() {
+    if (fetch) {
+        auto f = std::move(fetch);
+        fetch = nullptr;
+        f(*this);
+    }
+    if (ready() != NULL) {
+        ready.wait();
+        ready = cl::Event();
+    }
+}
+
 std::string slurpFile(std::string fname) {
     std::fstream in(fname);
     if (!in.is_open()) {
@@ -42,8 +173,60 @@ std::string slurpFile(std::string fname) {
     return sstr.str();
 }
 
+void printProfiling(const std::string *names, const double *times,
+    const unsigned *calls, int n)
+{
+    std::cout << "\nProfiling info:\n";
+    printl("Kernel");
+    printr("Calls", 8);
+    printr("Time (s)");
+    printr("Mean (ms)");
+    std::cout << std::setprecision(3) << std::fixed << std::endl;
+
+    int sumC = 0;
+    double sumT = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned c = calls[i];
+        double t = times[i];
+        double avg = (c ? (t / c) : 0.0) * 1e3;
+        sumC += c;
+        sumT += t;
+
+        printl(' ' + names[i]);
+        printr(c, 8);
+        printr(t);
+        printr(avg);
+        std::cout << std::endl;
+    }
+    printl("Total:");
+    printr(sumC, 8);
+    printr(sumT);
+    std::cout << "\n";
+}
+
+// one generator per thread, so concurrent batch jobs neither race on it nor
+// draw the same sequence
+static std::mt19937 &rng() {
+   thread_local std::mt19937 mt(std::random_device{}());
+   return mt;
+}
+
 float randf() {
-   static std::mt19937 mt(time(NULL));
-   static std::uniform_real_distribution<double> dist(-1.0, +1.0);
-   return dist(mt);
+   thread_local std::uniform_real_distribution<double> dist(-1.0, +1.0);
+   return dist(rng());
+}
+
+void seedRandom(unsigned seed) {
+   rng().seed(seed);
+}
+
+std::string randomState() {
+   std::ostringstream out;
+   out << rng();
+   return out.str();
+}
+
+void setRandomState(const std::string &state) {
+   std::istringstream in(state);
+   in >> rng();
 }
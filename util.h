@@ -6,16 +6,64 @@
 #include <iomanip>
 #include <iostream>
 #include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
 
 // an image in host memory
 class HostImage {
 public:
     HostImage(int w, int h);
     ~HostImage();
-    void write(std::string fname);
+    void write(std::string fname) const;
+
+    // wait for a pending device readback into data, if any
+    void sync();
 
     int w, h;
     char *data;
+    cl::Event ready;
+};
+
+// On-disk layout of an exported volume frame: this header, then nbricks
+// int32 (x, y, z) brick origins, then nchunks uint64 compressed chunk sizes,
+// then the chunks. Each chunk is a zlib stream of up to bricksPerChunk
+// bricks; a brick is bx*by*bz texels, x fastest, of one float per channel
+// (temperature, smoke, fuel, in that order, if present). Bricks at the far
+// faces may stick out of the grid; the texels past it repeat the edge ones.
+// Bricks not listed are empty: ambient temperature, no smoke or fuel.
+struct VolumeHeader {
+    char magic[8];              // "EXPLVOL" and a NUL
+    uint32_t version;
+    uint32_t nx, ny, nz;
+    uint32_t bx, by, bz;
+    uint32_t channels;          // ExportChannel bits
+    uint32_t nbricks, nchunks, bricksPerChunk;
+    float t;
+};
+
+// the non-empty bricks of one frame's T grid, in host memory
+class VolumeFrame {
+public:
+    VolumeFrame();
+    void write(std::string fname);
+    void read(std::string fname);
+
+    // finish a pending device readback into bricks and data, if any
+    void sync();
+
+    unsigned nx, ny, nz, bx, by, bz, channels;
+    float t;
+    std::vector<cl_int4> bricks;    // origins, in the order of data
+    std::vector<float> data;
+    cl::Event ready;
+
+    // the part of a readback the backend leaves to sync(), so that it runs
+    // on the thread that writes the frame; called once, then cleared
+    std::function<void(VolumeFrame &)> fetch;
 };
 
 std::string slurpFile(std::string fname);
@@ -42,6 +90,16 @@ inline double time_since(TimePoint &then) {
     return dur.count();
 }
 
+// print a per-kernel timing table (times in seconds)
+void printProfiling(const std::string *names, const double *times,
+    const unsigned *calls, int n);
+
 float randf();
+void seedRandom(unsigned seed);
+
+// this thread's generator state, as text; setting it back replays the same
+// draws from there on
+std::string randomState();
+void setRandomState(const std::string &state);
 
 #endif // __UTIL_H__